@@ -0,0 +1,155 @@
+/*
+ * asgn1_ctl - create, destroy and inspect asgn1 ramdisk instances.
+ *
+ *   asgn1_ctl create [minor]     new instance, first free minor by default
+ *   asgn1_ctl destroy <minor>    remove an instance that is not open
+ *   asgn1_ctl info [device]      max_users, open count and open queue of one instance
+ *   asgn1_ctl snapshot <device> [minor]
+ *                                point-in-time copy of device as a new instance
+ *   asgn1_ctl prealloc <device> <bytes> [offset]
+ *                                allocate and zero pages ahead of a write burst
+ *   asgn1_ctl follow <device>    copy device to stdout, then wait for appends
+ *
+ * create/destroy go through the control node (/dev/asgn1 by default,
+ * override with ASGN1_CTL_DEV) and need root, so does snapshot. prealloc
+ * needs write access to the device.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "asgn1_ioctl.h"
+
+static int open_node(const char *path, int flags)
+{
+    int fd = open(path, flags);
+
+    if (fd < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s create [minor]\n"
+            "       %s destroy <minor>\n"
+            "       %s info [device]\n"
+            "       %s snapshot <device> [minor]\n"
+            "       %s prealloc <device> <bytes> [offset]\n"
+            "       %s follow <device>\n", prog, prog, prog, prog, prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *ctl = getenv("ASGN1_CTL_DEV");
+    struct asgn1_open_stats os;
+    struct asgn1_falloc fa;
+    char buf[4096];
+    ssize_t n;
+    int fd, val;
+
+    if (!ctl)
+        ctl = "/dev/asgn1";
+    if (argc < 2)
+        usage(argv[0]);
+
+    if (!strcmp(argv[1], "create")) {
+        val = argc > 2 ? atoi(argv[2]) : -1;
+        fd = open_node(ctl, O_RDONLY);
+        if (ioctl(fd, ASGN1_IOCTL_CREATE_DEV, &val) < 0) {
+            fprintf(stderr, "create failed:  %s\n", strerror(errno));
+            return 1;
+        }
+        if (val)
+            printf("/dev/asgn1%d\n", val);
+        else
+            printf("/dev/asgn1\n");
+    } else if (!strcmp(argv[1], "destroy")) {
+        if (argc < 3)
+            usage(argv[0]);
+        val = atoi(argv[2]);
+        fd = open_node(ctl, O_RDONLY);
+        if (ioctl(fd, ASGN1_IOCTL_DESTROY_DEV, &val) < 0) {
+            fprintf(stderr, "destroy failed:  %s\n", strerror(errno));
+            return 1;
+        }
+    } else if (!strcmp(argv[1], "info")) {
+        fd = open_node(argc > 2 ? argv[2] : ctl, O_RDONLY);
+        if (ioctl(fd, ASGN1_IOCTL_GET_MAX_USERS, &val) < 0) {
+            fprintf(stderr, "ioctl failed:  %s\n", strerror(errno));
+            return 1;
+        }
+        printf("max_users:  %d\n", val);
+        if (ioctl(fd, ASGN1_IOCTL_GET_OPEN_COUNT, &val) < 0) {
+            fprintf(stderr, "ioctl failed:  %s\n", strerror(errno));
+            return 1;
+        }
+        // Our own open is included
+        printf("open_count: %d\n", val);
+        if (ioctl(fd, ASGN1_IOCTL_GET_OPEN_STATS, &os) < 0) {
+            fprintf(stderr, "ioctl failed:  %s\n", strerror(errno));
+            return 1;
+        }
+        printf("queued:     %u (max %u)\n", os.queued, os.queued_max);
+        printf("waited:     %llu opens, %llu ns total, %llu ns max\n",
+               (unsigned long long)os.waited, (unsigned long long)os.wait_ns,
+               (unsigned long long)os.wait_max_ns);
+        printf("rejected:   %llu\n", (unsigned long long)os.rejected);
+    } else if (!strcmp(argv[1], "snapshot")) {
+        if (argc < 3)
+            usage(argv[0]);
+        val = argc > 3 ? atoi(argv[3]) : -1;
+        fd = open_node(argv[2], O_RDONLY);
+        if (ioctl(fd, ASGN1_IOCTL_SNAPSHOT, &val) < 0) {
+            fprintf(stderr, "snapshot failed:  %s\n", strerror(errno));
+            return 1;
+        }
+        if (val)
+            printf("/dev/asgn1%d\n", val);
+        else
+            printf("/dev/asgn1\n");
+    } else if (!strcmp(argv[1], "prealloc")) {
+        if (argc < 4)
+            usage(argv[0]);
+        // Mode 0 extends the device to offset + bytes, like fallocate(1)
+        memset(&fa, 0, sizeof(fa));
+        fa.len = strtoull(argv[3], NULL, 0);
+        fa.offset = argc > 4 ? strtoull(argv[4], NULL, 0) : 0;
+        fd = open_node(argv[2], O_WRONLY);
+        if (ioctl(fd, ASGN1_IOCTL_FALLOCATE, &fa) < 0) {
+            fprintf(stderr, "prealloc failed:  %s\n", strerror(errno));
+            return 1;
+        }
+    } else if (!strcmp(argv[1], "follow")) {
+        if (argc < 3)
+            usage(argv[0]);
+        // Like tail -f, follow mode is per open file so only this reader waits
+        val = 1;
+        fd = open_node(argv[2], O_RDONLY);
+        if (ioctl(fd, ASGN1_IOCTL_SET_FOLLOW, &val) < 0) {
+            fprintf(stderr, "follow failed:  %s\n", strerror(errno));
+            return 1;
+        }
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            if (write(STDOUT_FILENO, buf, n) != n)
+                return 1;
+        }
+        if (n < 0) {
+            fprintf(stderr, "read failed:  %s\n", strerror(errno));
+            return 1;
+        }
+    } else {
+        usage(argv[0]);
+    }
+
+    close(fd);
+    return 0;
+}
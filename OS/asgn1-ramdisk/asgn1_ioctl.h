@@ -0,0 +1,105 @@
+/*
+ * asgn1_ioctl.h - ioctl interface of the asgn1 ramdisk.
+ *
+ * Shared by the driver (asgn1_skel.c) and the user-space programs, so
+ * both sides always agree on the command numbers and argument layouts.
+ */
+#ifndef ASGN1_IOCTL_H
+#define ASGN1_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ASGN1_IOCTL_BASE    0xF1
+
+// Set maximum concurrent opens (processes)
+#define ASGN1_IOCTL_SET_MAX_USERS   _IOW(ASGN1_IOCTL_BASE, 0x01, int)
+
+// Get maximum concurrent opens
+#define ASGN1_IOCTL_GET_MAX_USERS   _IOR(ASGN1_IOCTL_BASE, 0x02, int)
+
+// Get current open count
+#define ASGN1_IOCTL_GET_OPEN_COUNT  _IOR(ASGN1_IOCTL_BASE, 0x03, int)
+
+/*
+ * Create a new ramdisk instance. In: wanted minor, or -1 for the first
+ * free one. Out: the minor actually used. Node is /dev/asgn1<minor>,
+ * except minor 0 which keeps the plain /dev/asgn1 name.
+ * Needs CAP_SYS_ADMIN, may be issued on any asgn1 node.
+ */
+#define ASGN1_IOCTL_CREATE_DEV      _IOWR(ASGN1_IOCTL_BASE, 0x04, int)
+
+/*
+ * Destroy the ramdisk instance with the given minor and free its pages.
+ * Fails with EBUSY while the instance is open or mapped.
+ */
+#define ASGN1_IOCTL_DESTROY_DEV     _IOW(ASGN1_IOCTL_BASE, 0x05, int)
+
+/*
+ * fallocate(2) for the ramdisk, which the VFS refuses on char devices.
+ * mode takes the FALLOC_FL_* flags of <linux/falloc.h>:
+ *   0 [| FALLOC_FL_KEEP_SIZE]                   give every hole a zeroed page, data
+ *                                               already there stays. Without KEEP_SIZE
+ *                                               extend to offset + len. Dedup and
+ *                                               compression skip them until written
+ *   FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE  free the range, it reads as zeros
+ *   FALLOC_FL_ZERO_RANGE [| FALLOC_FL_KEEP_SIZE] the same, and without
+ *                                               KEEP_SIZE extend to offset + len
+ * Punching and zeroing clear partial pages at either end in place.
+ * Needs the node open for writing.
+ */
+struct asgn1_falloc {
+    __u32 mode;
+    __u32 pad;
+    __u64 offset;
+    __u64 len;
+};
+
+#define ASGN1_IOCTL_FALLOCATE       _IOW(ASGN1_IOCTL_BASE, 0x06, struct asgn1_falloc)
+
+/*
+ * Snapshot the instance this is issued on into a new instance. In: wanted
+ * minor, or -1 for the first free one. Out: the minor actually used.
+ * The snapshot shares every page with the original, later writes to
+ * either copy only the pages they touch. It is an ordinary instance:
+ * read it through /dev/asgn1<minor>, remove it with DESTROY_DEV.
+ * Needs CAP_SYS_ADMIN.
+ */
+#define ASGN1_IOCTL_SNAPSHOT        _IOWR(ASGN1_IOCTL_BASE, 0x07, int)
+
+/*
+ * Open admission of the instance this is issued on. Opens past max_users
+ * queue and are let in oldest first as holders close, O_NONBLOCK opens
+ * fail with EBUSY instead. open_count includes the caller's own open.
+ *   queued, queued_max   openers waiting now, and the most ever waiting
+ *   waited, wait_ns      opens that had to queue, and their total wait
+ *   wait_max_ns          longest single wait
+ *   rejected             O_NONBLOCK opens refused
+ */
+struct asgn1_open_stats {
+    __u32 open_count;
+    __u32 max_users;
+    __u32 queued;
+    __u32 queued_max;
+    __u64 waited;
+    __u64 wait_ns;
+    __u64 wait_max_ns;
+    __u64 rejected;
+};
+
+#define ASGN1_IOCTL_GET_OPEN_STATS  _IOR(ASGN1_IOCTL_BASE, 0x08, struct asgn1_open_stats)
+
+/*
+ * Tail-follow mode of the open file it is issued on, off after open.
+ * When on, read() at EOF waits for the size to grow past the file position
+ * instead of returning 0 (EAGAIN with O_NONBLOCK or RWF_NOWAIT), and poll()
+ * reports POLLIN only once there is data past it. Turning it off wakes
+ * this file's waiting readers with EOF. Other opens are not affected.
+ */
+#define ASGN1_IOCTL_SET_FOLLOW      _IOW(ASGN1_IOCTL_BASE, 0x09, int)
+#define ASGN1_IOCTL_GET_FOLLOW      _IOR(ASGN1_IOCTL_BASE, 0x0a, int)
+
+// Upper bound on instances (minors) per module load
+#define ASGN1_MAX_DEVS      64
+
+#endif /* ASGN1_IOCTL_H */
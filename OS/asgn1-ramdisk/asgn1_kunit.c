@@ -0,0 +1,219 @@
+/*
+ * asgn1_kunit.c - KUnit tests and microbenchmarks of the asgn1 page store.
+ *
+ * Built into the module with `make ASGN1_KUNIT=y` against a kernel with
+ * CONFIG_KUNIT, and #included at the end of asgn1_skel.c so it can reach
+ * the static store functions. Every case gets a bare instance from
+ * asgn1_dev_alloc(): no node, no block device, no checkpoint file, no
+ * background work. The suite runs when the module loads, results go to
+ * the kernel log and /sys/kernel/debug/kunit/asgn1_store/results.
+ *
+ * The benchmark covers stores spanning 1K, 1M and 16M page indices. 16M
+ * pages are 64 GiB, more than a UML or QEMU guest has, so at most
+ * ASGN1_KUNIT_RESIDENT pages are stored, spread evenly over the span.
+ * The xarray is then as tall as in a full store of that size, which is
+ * what lookup, grow and free scale with. Times are per page.
+ */
+#include <kunit/test.h>
+
+#define ASGN1_KUNIT_RESIDENT    16384       // pages, 64 MiB with 4K pages
+#define ASGN1_KUNIT_LOOKUPS     (1UL << 20)
+
+static int asgn1_kunit_init(struct kunit *test)
+{
+    test->priv = asgn1_dev_alloc();
+    return test->priv ? 0 : -ENOMEM;
+}
+
+static void asgn1_kunit_exit(struct kunit *test)
+{
+    asgn1_dev_free(test->priv);
+}
+
+static bool asgn1_kunit_page_zero(struct page *page)
+{
+    void *kaddr = kmap_local_page(page);
+    bool zero = !memchr_inv(kaddr, 0, PAGE_SIZE);
+
+    kunmap_local(kaddr);
+    return zero;
+}
+
+// Grow fills exactly the holes of the range, with zeroed pages
+static void asgn1_test_ensure_lookup(struct kunit *test)
+{
+    struct asgn1_dev *dev = test->priv;
+    struct asgn1_range r;
+    struct page *page = NULL;
+    pgoff_t i;
+
+    asgn1_range_lock(dev, &r, 0, ASGN1_RANGE_ALL, true);
+
+    KUNIT_EXPECT_EQ(test, asgn1_ensure_range_locked(dev, 10, 19), 0);
+    KUNIT_EXPECT_EQ(test, dev->nr_pages, (size_t)10);
+    KUNIT_EXPECT_EQ(test, dev->end_index, (pgoff_t)20);
+    KUNIT_EXPECT_NULL(test, asgn1_get_nth_page_locked(dev, 9));
+    KUNIT_EXPECT_NULL(test, asgn1_get_nth_page_locked(dev, 20));
+    for (i = 10; i < 20; i++) {
+        page = asgn1_get_nth_page_locked(dev, i);
+        KUNIT_ASSERT_NOT_NULL(test, page);
+        KUNIT_EXPECT_TRUE(test, asgn1_kunit_page_zero(page));
+    }
+
+    // An overlapping range keeps the pages it already has
+    KUNIT_EXPECT_EQ(test, asgn1_ensure_range_locked(dev, 15, 24), 0);
+    KUNIT_EXPECT_EQ(test, dev->nr_pages, (size_t)15);
+    KUNIT_EXPECT_PTR_EQ(test, asgn1_get_nth_page_locked(dev, 19), page);
+    KUNIT_EXPECT_EQ(test, asgn1_stat_sum(dev, ASGN1_STAT_PAGES_ALLOCATED), (u64)15);
+
+    asgn1_range_unlock(dev, &r);
+}
+
+// Paged copy across page boundaries, holes read as zeros
+static void asgn1_test_copy(struct kunit *test)
+{
+    struct asgn1_dev *dev = test->priv;
+    size_t pos = PAGE_SIZE - 100, len = 2 * PAGE_SIZE, all = 4 * PAGE_SIZE;
+    struct asgn1_range r;
+    struct iov_iter iter;
+    struct kvec kv;
+    u8 *in, *out;
+    size_t i;
+
+    in = kunit_kmalloc(test, len, GFP_KERNEL);
+    out = kunit_kzalloc(test, all, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    for (i = 0; i < len; i++)
+        in[i] = i * 7 + 1;
+
+    asgn1_range_lock(dev, &r, 0, ASGN1_RANGE_ALL, true);
+    KUNIT_ASSERT_EQ(test, asgn1_ensure_range_locked(dev, pos >> PAGE_SHIFT,
+                                                    (pos + len - 1) >> PAGE_SHIFT), 0);
+
+    kv.iov_base = in;
+    kv.iov_len = len;
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+    KUNIT_EXPECT_EQ(test, asgn1_copy_from_iter_locked(dev, pos, len, &iter, false),
+                    (ssize_t)len);
+    KUNIT_EXPECT_TRUE(test, xa_get_mark(dev->pages, 1, ASGN1_MARK_DIRTY));
+
+    // Pages 0-2 hold the data, page 3 is a hole
+    kv.iov_base = out;
+    kv.iov_len = all;
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, all);
+    KUNIT_EXPECT_EQ(test, asgn1_copy_to_iter_locked(dev, 0, all, &iter), (ssize_t)all);
+    KUNIT_EXPECT_NULL(test, memchr_inv(out, 0, pos));
+    KUNIT_EXPECT_EQ(test, memcmp(out + pos, in, len), 0);
+    KUNIT_EXPECT_NULL(test, memchr_inv(out + pos + len, 0, all - pos - len));
+
+    // Writes never allocate here, a hole stops them before the first byte
+    kv.iov_base = in;
+    kv.iov_len = len;
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+    KUNIT_EXPECT_EQ(test, asgn1_copy_from_iter_locked(dev, 8 * PAGE_SIZE, len, &iter, true),
+                    (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, asgn1_copy_from_iter_locked(dev, 8 * PAGE_SIZE, len, &iter, false),
+                    (ssize_t)-EIO);
+
+    asgn1_range_unlock(dev, &r);
+}
+
+// Freeing empties the store and the pool takes the pages back
+static void asgn1_test_free_all(struct kunit *test)
+{
+    struct asgn1_dev *dev = test->priv;
+    struct asgn1_range r;
+
+    asgn1_range_lock(dev, &r, 0, ASGN1_RANGE_ALL, true);
+    KUNIT_ASSERT_EQ(test, asgn1_ensure_range_locked(dev, 0, 99), 0);
+    asgn1_extend_size(dev, 100 * PAGE_SIZE);
+
+    asgn1_free_all_pages_locked(dev);
+    KUNIT_EXPECT_EQ(test, dev->nr_pages, (size_t)0);
+    KUNIT_EXPECT_EQ(test, dev->end_index, (pgoff_t)0);
+    KUNIT_EXPECT_EQ(test, asgn1_size(dev), (size_t)0);
+    KUNIT_EXPECT_TRUE(test, xa_empty(dev->pages));
+    KUNIT_EXPECT_EQ(test, asgn1_stat_sum(dev, ASGN1_STAT_PAGES_FREED), (u64)100);
+    KUNIT_EXPECT_EQ(test, dev->pool_nr, 100UL);
+
+    // The next grow is served from the pool
+    KUNIT_EXPECT_EQ(test, asgn1_ensure_range_locked(dev, 0, 99), 0);
+    KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->pool_hits), 100L);
+    KUNIT_EXPECT_TRUE(test, asgn1_kunit_page_zero(asgn1_get_nth_page_locked(dev, 50)));
+
+    asgn1_range_unlock(dev, &r);
+}
+
+static const unsigned long asgn1_bench_spans[] = { 1UL << 10, 1UL << 20, 1UL << 24 };
+
+static void asgn1_bench_desc(const unsigned long *span, char *desc)
+{
+    snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%lu pages", *span);
+}
+
+KUNIT_ARRAY_PARAM(asgn1_bench, asgn1_bench_spans, asgn1_bench_desc);
+
+/*
+* 1. grow: one asgn1_ensure_range_locked() per page, into empty holes
+* 2. lookup: asgn1_get_nth_page_locked() over every page, repeated up to
+*    ASGN1_KUNIT_LOOKUPS calls
+* 3. free: asgn1_free_all_pages_locked(), pages go to the pool first
+*/
+static void asgn1_bench_store(struct kunit *test)
+{
+    const unsigned long span = *(const unsigned long *)test->param_value;
+    unsigned long nr = min_t(unsigned long, span, ASGN1_KUNIT_RESIDENT);
+    unsigned long stride = span / nr, passes = max(1UL, ASGN1_KUNIT_LOOKUPS / nr);
+    unsigned long i, n, missing = 0;
+    struct asgn1_dev *dev = test->priv;
+    u64 t0, grow_ns, lookup_ns, free_ns;
+    struct asgn1_range r;
+
+    if (si_mem_available() < (long)(2 * nr))
+        kunit_skip(test, "needs %lu free pages", 2 * nr);
+
+    asgn1_range_lock(dev, &r, 0, ASGN1_RANGE_ALL, true);
+
+    t0 = ktime_get_ns();
+    for (i = 0; i < nr; i++)
+        if (asgn1_ensure_range_locked(dev, i * stride, i * stride))
+            break;
+    grow_ns = ktime_get_ns() - t0;
+    KUNIT_ASSERT_EQ(test, i, nr);
+
+    t0 = ktime_get_ns();
+    for (n = 0; n < passes; n++)
+        for (i = 0; i < nr; i++)
+            if (!asgn1_get_nth_page_locked(dev, i * stride))
+                missing++;
+    lookup_ns = ktime_get_ns() - t0;
+    KUNIT_EXPECT_EQ(test, missing, 0UL);
+
+    t0 = ktime_get_ns();
+    asgn1_free_all_pages_locked(dev);
+    free_ns = ktime_get_ns() - t0;
+
+    asgn1_range_unlock(dev, &r);
+
+    kunit_info(test, "span %lu pages, %lu stored: grow %llu ns/page, lookup %llu ns/op, free %llu ns/page\n",
+               span, nr, div64_u64(grow_ns, nr), div64_u64(lookup_ns, (u64)nr * passes),
+               div64_u64(free_ns, nr));
+}
+
+static struct kunit_case asgn1_store_cases[] = {
+    KUNIT_CASE(asgn1_test_ensure_lookup),
+    KUNIT_CASE(asgn1_test_copy),
+    KUNIT_CASE(asgn1_test_free_all),
+    KUNIT_CASE_PARAM(asgn1_bench_store, asgn1_bench_gen_params),
+    {}
+};
+
+static struct kunit_suite asgn1_store_suite = {
+    .name = "asgn1_store",
+    .init = asgn1_kunit_init,
+    .exit = asgn1_kunit_exit,
+    .test_cases = asgn1_store_cases,
+};
+
+kunit_test_suite(asgn1_store_suite);
@@ -1,398 +1,4568 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/kref.h>
+#include <linux/capability.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
-#include <linux/list.h>
+#include <linux/huge_mm.h>
+#include <linux/fadvise.h>
+#include <linux/log2.h>
+#include <linux/xarray.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/version.h>
 #include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/overflow.h>
+#include <linux/shrinker.h>
+#include <linux/lz4.h>
+#include <linux/xxhash.h>
+#include <linux/ktime.h>
 #include <linux/highmem.h> 
+#include <linux/pagemap.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/file.h>
+#include <linux/rmap.h>
+#include <linux/delay.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+
+#include "asgn1_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "asgn1_trace.h"
 
 #define DRV_NAME        "asgn1"
-#define DRV_DESC        "Virtual Ramdisk (paged, list-backed)"
+#define DRV_DESC        "Virtual Ramdisk (paged, xarray-backed)"
 #define DRV_AUTHOR      "Vishravars Ramasubramanian"
 #define DRV_LICENSE     "GPL"
 
+static dev_t asgn1_devt;               // first of ASGN1_MAX_DEVS minors
 static int asgn1_major = 0;            // dynamically allocate a major
 static const char *asgn1_name = DRV_NAME;
+static struct class *asgn1_class;
+
+static int ndevices = 1;
+module_param(ndevices, int, 0444);
+MODULE_PARM_DESC(ndevices, "Number of ramdisk instances created at load, 1..64 (default 1)");
+
+static unsigned long blk_mb = 1024;
+module_param(blk_mb, ulong, 0444);
+MODULE_PARM_DESC(blk_mb, "Size of each instance's block device in MiB, 0 for none (default 1024)");
+
+static char *backing_dir;
+module_param(backing_dir, charp, 0444);
+MODULE_PARM_DESC(backing_dir, "Absolute directory for per-instance checkpoint images, unset for none");
+
+/*
+ * Huge extents are PMD sized (2 MiB on x86-64). PMD mappings of them need
+ * THP and vmf_insert_folio_pmd(), older kernels map them with PTEs.
+ */
+#define ASGN1_HPAGE_ORDER   (PMD_SHIFT - PAGE_SHIFT)
+#define ASGN1_HPAGE_NR      (1UL << ASGN1_HPAGE_ORDER)
+
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+#define ASGN1_PMD_MAP       1
+#endif
+
+/*
+ * Fault-around: pages mapped per trap. The user window is a sysfs tunable,
+ * faults raised by the kernel itself (MAP_POPULATE, mlock) get the larger
+ * populate window. Pages are handed to vm_insert_pages() in batches.
+ */
+#define ASGN1_FAULT_AROUND_DEF  16
+#define ASGN1_POPULATE_PAGES    4096
+#define ASGN1_MAP_BATCH         32
+
+/*
+ * xarray mark on pages written since they were last cleaned, through
+ * write() or a shared writable mapping.
+ */
+#define ASGN1_MARK_DIRTY        XA_MARK_0
+
+/*
+ * Truncate reclaim: stores of at least ASGN1_RECLAIM_INLINE pages are
+ * freed by workers, which claim ASGN1_RECLAIM_CHUNK indices (a multiple
+ * of a huge extent) at a time and free ASGN1_RECLAIM_BATCH pages per call.
+ */
+#define ASGN1_RECLAIM_INLINE    1024
+#define ASGN1_RECLAIM_CHUNK     8192
+#define ASGN1_RECLAIM_BATCH     64
+
+// Recycle pool bound per instance, in pages (64 MiB), tunable in sysfs
+#define ASGN1_POOL_MAX_DEF      16384
+
+/*
+ * Growth takes up to ASGN1_GROW_BATCH pages per bulk allocation, one
+ * xarray node's worth. Preallocation holds ASGN1_PREALLOC_CHUNK indices
+ * (a multiple of a huge extent) at a time, so I/O elsewhere in the range
+ * and signals get a look in between chunks.
+ */
+#define ASGN1_GROW_BATCH        64
+#define ASGN1_PREALLOC_CHUNK    8192
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#define asgn1_alloc_pages_bulk(gfp, nid, nr, pages) alloc_pages_bulk_node(gfp, nid, nr, pages)
+#else
+#define asgn1_alloc_pages_bulk(gfp, nid, nr, pages) alloc_pages_bulk_array_node(gfp, nid, nr, pages)
+#endif
+
+/*
+ * Cold page compression. XA_MARK_1 is a reference bit set on every access
+ * while compression is on, the scan clears it, so a page found without it
+ * went a whole interval untouched. Pages that don't shrink to 3/4 are
+ * marked incompressible until written again. Preallocated pages carry
+ * the same mark, so they stay resident (and the dedup scan doesn't punch
+ * them) until written. The scan holds
+ * ASGN1_COMPRESS_CHUNK indices exclusively at a time, busy chunks are hot
+ * and get skipped.
+ */
+#define ASGN1_MARK_ACCESSED     XA_MARK_1
+#define ASGN1_MARK_INCOMPR      XA_MARK_2
+#define ASGN1_COMPRESS_MAX      (PAGE_SIZE * 3 / 4)
+#define ASGN1_COMPRESS_CHUNK    64
+
+// Compressed pages live in the store as tagged struct asgn1_zpage pointers
+#define ASGN1_TAG_ZPAGE         1
+
+struct asgn1_zpage {
+    unsigned int len;
+    u8 data[];
+};
+
+/*
+ * Content deduplication. The scan looks at dedup_pages stored pages every
+ * dedup_interval_ms, ASGN1_DEDUP_CHUNK indices held exclusively at a time.
+ * All-zero pages are punched into holes. Other pages are hashed with
+ * xxh64 into a table that lives for one sweep of the image, and pages
+ * whose contents really match are merged into one shared page. The table
+ * gets a bucket per index up to end_index at the start of the sweep,
+ * within [ASGN1_DEDUP_BUCKETS_MIN, ASGN1_DEDUP_BUCKETS_MAX], and remembers
+ * at most ASGN1_DEDUP_NODES_MAX hashes (32 MiB). Past that a sweep still
+ * punches zero pages and merges into the hashes it has.
+ */
+#define ASGN1_DEDUP_PAGES_DEF   1024
+#define ASGN1_DEDUP_CHUNK       64
+#define ASGN1_DEDUP_BUCKETS_MIN 4096
+#define ASGN1_DEDUP_BUCKETS_MAX (1UL << 20)
+#define ASGN1_DEDUP_NODES_MAX   (1UL << 20)
 
-#define ASGN1_IOCTL_BASE    0xF1
+// Deduplicated indices hold a tagged struct asgn1_shared pointer each (tag 2 is the xarray's)
+#define ASGN1_TAG_SHARED        3
 
-// Set maximum concurrent opens (processes)
-#define ASGN1_IOCTL_SET_MAX_USERS   _IOW(ASGN1_IOCTL_BASE, 0x01, int)
+/*
+ * One read-only page shared by users indices, of this or other instances
+ * (snapshots). The page is never mapped writable or attached to a
+ * mapping, writers unshare it first. users only drops to 1 when every
+ * other holder is gone, so seeing 1 means the page is ours alone. A
+ * subpage of a huge extent holds its own folio reference.
+ */
+struct asgn1_shared {
+    struct page *page;
+    atomic_t users;
+};
+
+struct asgn1_dedup_node {
+    struct hlist_node node;
+    u64 hash;
+    pgoff_t index;
+};
+
+// Block device frontend: /dev/asgn1b<minor>, room for 15 partitions each
+#define ASGN1_BLK_MINORS        16
+#define ASGN1_BLK_QUEUE_DEPTH   128
+
+/*
+ * Checkpoints to <backing_dir>/asgn1<minor>.img: a header page, then store
+ * page i at file offset (i + 1) * PAGE_SIZE, holes left as file holes.
+ * ASGN1_MARK_DIRTY says what changed since the last checkpoint, stores
+ * through mmap are caught by write protecting the page when it is
+ * checkpointed. ASGN1_CKPT_BATCH indices are copied per range lock hold.
+ */
+#define ASGN1_CKPT_MAGIC        "ASGN1IMG"
+#define ASGN1_CKPT_VERSION      1
+#define ASGN1_CKPT_BATCH        128
+#define ASGN1_CKPT_INTERVAL_DEF 10000
+#define ASGN1_CKPT_BUDGET_DEF   500         // us of foreground latency
+#define ASGN1_CKPT_STALL_MAX    1000        // ms one batch may yield for
+#define ASGN1_FG_IDLE_NS        (10 * NSEC_PER_MSEC)
+
+struct asgn1_ckpt_hdr {
+    char magic[8];
+    __le32 version;
+    __le32 page_size;
+    __le64 size_bytes;
+};
+
+// One checkpoint's (or restore's) staging, too big for the stack
+struct asgn1_ckpt {
+    struct page *stage[ASGN1_CKPT_BATCH];
+    struct bio_vec bv[ASGN1_CKPT_BATCH];
+    pgoff_t index[ASGN1_CKPT_BATCH];
+};
+
+/*
+ * Per-CPU statistics, summed over CPUs when read. The hot paths only do
+ * this_cpu_add(), and only time a lock when they had to wait for it.
+ */
+enum asgn1_stat {
+    ASGN1_STAT_PTE_FAULTS,
+    ASGN1_STAT_PMD_FAULTS,
+    ASGN1_STAT_PREFAULTED,          // neighbours mapped ahead of a trap
+    ASGN1_STAT_PAGES_ALLOCATED,     // store pages, pool hits included
+    ASGN1_STAT_PAGES_FREED,         // store pages, to the pool included
+    ASGN1_STAT_RANGE_LOCKS,         // range lock attempts
+    ASGN1_STAT_RANGE_WALKED,        // held ranges they walked past
+    ASGN1_STAT_RANGE_WAITS,         // acquisitions that had to sleep
+    ASGN1_STAT_RANGE_WAIT_NS,
+    ASGN1_STAT_GROW_WAITS,          // grow_lock acquisitions that had to sleep
+    ASGN1_STAT_GROW_WAIT_NS,
+    ASGN1_NR_STATS
+};
+
+// Timed operations, each with its own latency histogram
+enum asgn1_op {
+    ASGN1_OP_READ,
+    ASGN1_OP_WRITE,
+    ASGN1_OP_FAULT,
+    ASGN1_OP_BLK_READ,
+    ASGN1_OP_BLK_WRITE,
+    ASGN1_NR_OPS
+};
+
+/*
+ * Where new store pages are placed, per instance (sysfs numa_policy).
+ * LOCAL: the allocating task's policy, normally the node it runs on.
+ * INTERLEAVE: round robin over the nodes with memory, so a large image
+ * is spread over every memory controller.
+ * BIND: numa_node only, allocation fails rather than spilling over.
+ * The recycle pool doesn't track nodes, so only LOCAL uses it.
+ */
+enum asgn1_numa {
+    ASGN1_NUMA_LOCAL,
+    ASGN1_NUMA_INTERLEAVE,
+    ASGN1_NUMA_BIND,
+};
+
+static const char * const asgn1_numa_names[] = {
+    [ASGN1_NUMA_LOCAL]      = "local",
+    [ASGN1_NUMA_INTERLEAVE] = "interleave",
+    [ASGN1_NUMA_BIND]       = "bind",
+};
+
+// Indices per range lock hold in whole-store walks (node_pages, last release)
+#define ASGN1_WALK_CHUNK        1024
 
-// Get maximum concurrent opens
-#define ASGN1_IOCTL_GET_MAX_USERS   _IOR(ASGN1_IOCTL_BASE, 0x02, int)
+// Bucket b counts latencies in [2^(b-1), 2^b) ns, the last one everything slower
+#define ASGN1_HIST_BUCKETS      32
 
-// Get current open count
-#define ASGN1_IOCTL_GET_OPEN_COUNT  _IOR(ASGN1_IOCTL_BASE, 0x03, int)
+struct asgn1_stats {
+    u64 stat[ASGN1_NR_STATS];
+    u64 ops[ASGN1_NR_OPS];
+    u64 bytes[ASGN1_NR_OPS];
+    u64 lat_ns[ASGN1_NR_OPS];
+    u64 hist[ASGN1_NR_OPS][ASGN1_HIST_BUCKETS];
+};
 
 #define asgn1_kmap_local(page)      kmap_local_page(page)
 #define asgn1_kunmap_local(addr)    kunmap_local(addr)
 
+// Holes are mapped with the zero pfn, pfn_t went away in 6.17
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define asgn1_zero_pfn(addr)        my_zero_pfn(addr)
+#else
+#define asgn1_zero_pfn(addr)        pfn_to_pfn_t(my_zero_pfn(addr))
+#endif
 
-struct page_node {
 
-    struct list_head list;     // kernel's doubly-lnk list node
-    struct page *page;         // Pointer to the kernel page.. 4KB?
+/*
+ * A held (or wanted) range of page indices, [first, last] inclusive.
+ * Shared ranges may overlap each other; an exclusive range overlaps nothing.
+ */
+struct asgn1_range {
+    struct list_head node;
+    pgoff_t first;
+    pgoff_t last;
+    bool excl;
+    u64 wait_ns;        // slept for it, 0 if it was free
 };
 
+#define ASGN1_RANGE_ALL     ULONG_MAX
+
 /*
  * struct Represents the state of the ramdisk device.
- * 1. pages: The head of a doubly-linked list of page_node structures.
- * 2. size_bytes: The current logical size of the ramdisk content.
- * 3. lock, max_users, open_count: For synchronization and access control.
+ * 1. pages: xarray indexed by page number, each entry a struct page *.
+ *    Sparse: an index below EOF with no entry is a hole and reads as zeros.
+ *    Truncate swaps in a fresh xarray, only use it under the range lock.
+ * 2. nr_pages: Number of pages stored in @pages. Entries are only added
+ *    or removed under grow_lock, nr_pages is read with READ_ONCE().
+ *    end_index: One past the highest index stored since the last truncate.
+ * 3. size_bytes: The current logical size, read without any lock.
+ * 4. range_lock, ranges, range_wq: Page range lock. Readers and faults take
+ *    their pages shared, writers exclusive, truncate takes everything.
+ * 5. lock, max_users, open_count: Open-time access control only.
+ *    open_waiters, open_wq: Openers queued behind max_users, oldest
+ *    first, admitted by asgn1_admit_locked(). The open_* counters below
+ *    them are read through ASGN1_IOCTL_GET_OPEN_STATS. All under lock.
+ * 6. minor, cdev, device: This instance's node, /dev/asgn1<minor>.
+ * 7. ref, dead: Lifetime. The device table holds one ref and every
+ *    open file one more. dead is set under lock once it is destroyed.
+ * 8. huge: Grow in PMD sized compound extents where the index is aligned.
+ *    Counters below it are exported through sysfs.
+ * 9. fault_around: Power of two window of pages mapped per user fault.
+ * 10. mapping: address_space every open file of this instance shares, so
+ *     unmap_mapping_range() reaches all its mmaps. NULL while not open.
+ *     It belongs to the inode of the node opened first, mapping_aops holds
+ *     that inode's own a_ops until the last release puts them back.
+ * 11. nr_dirty: Pages carrying ASGN1_MARK_DIRTY.
+ * 12. reclaim_backlog: Pages of truncated stores still queued for the
+ *     reclaim workers. They hold a ref on the instance until done.
+ * 13. pool: Pages freed by truncate or hole punching, kept for reuse by
+ *     the next writes, up to pool_max. shrinker empties it under memory
+ *     pressure. One list per instance, not per CPU: takers are already
+ *     serialized by grow_lock, and givers hand over whole batches.
+ * 14. compress_*: Cold page compression. compress_work scans the store
+ *     every compress_interval_ms and swaps cold pages for LZ4 copies,
+ *     the next access decompresses them again.
+ * 15. dedup_*: Zero page and duplicate page scan. dedup_work resumes at
+ *     dedup_cursor every dedup_interval_ms, dedup_table is private to it.
+ *     nr_shared counts the entries that point at a shared page, made by
+ *     the dedup scan or by a snapshot.
+ * 16. tag_set, disk: The blk-mq block device over the same store, NULL
+ *     disk when blk_mb is 0. One hardware queue per CPU.
+ * 17. ckpt_*: Checkpoints to ckpt_file, NULL without backing_dir.
+ *     ckpt_work writes what changed every ckpt_interval_ms: the pages
+ *     marked dirty and the indices punched meanwhile, in ckpt_holes.
+ *     ckpt_full asks for a full rewrite (truncate, failed write).
+ *     fg_lat_ns and fg_last_ns track read/write latency for the throttle.
+ * 18. stats: Per-CPU counters and latency histograms, see struct
+ *     asgn1_stats. debugfs is this instance's asgn1/<node>/ directory.
+ * 19. numa_*: Placement of new pages, see enum asgn1_numa. numa_next is
+ *     the node the last interleaved page went to.
+ * 20. data_wq: Readers at EOF in follow mode sleep on it (so do pollers,
+ *     always) and every size increase wakes them all, see struct asgn1_file.
  */
 struct asgn1_dev {
-    struct list_head pages;
-    size_t size_bytes;
+    struct xarray *pages;
+    size_t nr_pages;
+    pgoff_t end_index;
+    struct mutex grow_lock;
+    atomic_long_t size_bytes;
+
+    spinlock_t range_lock;
+    struct list_head ranges;
+    wait_queue_head_t range_wq;
+
     struct mutex lock;
     int max_users;
     atomic_t open_count;
+    struct list_head open_waiters;
+    wait_queue_head_t open_wq;
+    unsigned int open_queued;        // entries on open_waiters
+    unsigned int open_queued_max;    // deepest open_waiters has been
+    u64 open_waited;                 // opens admitted after queueing
+    u64 open_wait_ns;                // total time they spent queued
+    u64 open_wait_max_ns;
+    u64 open_rejected;               // O_NONBLOCK opens refused with EBUSY
+
+    int minor;
+    struct cdev *cdev;
+    struct device *device;
+    struct kref ref;
+    bool dead;
+
+    bool huge;
+    atomic_long_t nr_huge;           // huge extents in the store
+    atomic_long_t huge_alloc_fails;  // fell back to order-0
+
+    unsigned int fault_around;
+
+    unsigned int numa_policy;        // enum asgn1_numa
+    int numa_node;                   // ASGN1_NUMA_BIND target
+    int numa_next;
+
+    wait_queue_head_t data_wq;
+    atomic_long_t follow_waits;
+
+    struct address_space *mapping;
+    const struct address_space_operations *mapping_aops;
+    atomic_long_t nr_dirty;
+    atomic_long_t mmap_grown;        // pages allocated by faults past EOF
+    atomic_long_t hole_maps;         // zero page mapped over a hole
+
+    atomic_long_t reclaim_backlog;   // truncated pages not yet freed
+
+    spinlock_t pool_lock;
+    struct list_head pool;           // free order-0 pages, linked by page->lru
+    unsigned long pool_nr;
+    unsigned long pool_max;
+    atomic_long_t pool_hits;
+    atomic_long_t pool_misses;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    struct shrinker *shrinker;
+#else
+    struct shrinker shrinker;
+#endif
+
+    unsigned int compress_interval_ms;   // 0 == off
+    bool compress_primed;
+    struct delayed_work compress_work;
+    atomic_long_t nr_compressed;
+    atomic_long_t compressed_bytes;
+    atomic_long_t decompressions;
+    atomic_long_t decompress_ns;     // total, divide by decompressions
+
+    unsigned int dedup_interval_ms;      // 0 == off
+    unsigned int dedup_pages;            // scanned per interval
+    struct delayed_work dedup_work;
+    struct hlist_head *dedup_table;      // this sweep's hashes, NULL between sweeps
+    unsigned long dedup_buckets;         // power of two
+    unsigned long dedup_nodes;           // hashes in dedup_table
+    pgoff_t dedup_cursor;
+    atomic_long_t nr_shared;         // entries pointing at a shared page
+    atomic_long_t zero_pages;        // all-zero pages punched
+    atomic_long_t cow_breaks;        // shared pages unshared for a write
+    atomic_long_t dedup_scans;       // full sweeps
+
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *disk;
+
+    struct file *ckpt_file;
+    char *ckpt_path;
+    unsigned int ckpt_interval_ms;       // 0 == only at unload
+    unsigned int ckpt_budget_us;         // 0 == never yield
+    bool ckpt_full;
+    bool ckpt_discard;                   // destroyed on request, drop the image
+    size_t ckpt_size;                    // size in the image header
+    struct xarray ckpt_holes;
+    struct delayed_work ckpt_work;
+    atomic_long_t fg_lat_ns;         // moving average of read/write latency
+    u64 fg_last_ns;                  // last read/write completion
+    atomic_long_t checkpoints;
+    atomic_long_t ckpt_pages;        // pages written, all checkpoints
+    atomic_long_t ckpt_throttled;    // sleeps yielding to foreground I/O
+    atomic_long_t restored_pages;
+
+    struct asgn1_stats __percpu *stats;
+    struct dentry *debugfs;
+};
+
+/*
+* 1. Per-open state, filp->private_data
+* 2. follow: read() at EOF waits for the size to grow (EAGAIN with
+*    O_NONBLOCK), set with ASGN1_IOCTL_SET_FOLLOW. Off is plain EOF
+*/
+struct asgn1_file {
+    struct asgn1_dev *dev;
+    bool follow;
 };
 
-static struct asgn1_dev gdev;
+static inline struct asgn1_dev *asgn1_file_dev(struct file *filp)
+{
+    return ((struct asgn1_file *)filp->private_data)->dev;
+}
+
+// Live instances by minor, guarded by asgn1_devs_lock
+static struct asgn1_dev *asgn1_devs[ASGN1_MAX_DEVS];
+static DEFINE_MUTEX(asgn1_devs_lock);
+
+// Unbound workers freeing truncated stores
+static struct workqueue_struct *asgn1_reclaim_wq;
+
+static int asgn1_blk_major;
+
+static struct dentry *asgn1_debugfs;
+
+static void asgn1_dev_release(struct kref *ref);
+
+/* ---------- statistics ---------- */
+
+static inline void asgn1_stat_add(struct asgn1_dev *dev, enum asgn1_stat i, u64 v)
+{
+    this_cpu_add(dev->stats->stat[i], v);
+}
+
+static u64 asgn1_stat_sum(struct asgn1_dev *dev, enum asgn1_stat i)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(dev->stats, cpu)->stat[i];
+    return sum;
+}
+
+// Fold one read or write into fg_lat_ns, for the checkpoint throttle
+static void asgn1_fg_account(struct asgn1_dev *dev, u64 ns, u64 now)
+{
+    long avg;
 
-/* ---------- page lst manage fns ---------- */
+    if (!dev->ckpt_file)
+        return;
+    // Racy on purpose, an average over the last ~8 calls can lose one
+    avg = atomic_long_read(&dev->fg_lat_ns);
+    atomic_long_set(&dev->fg_lat_ns, avg + ((long)ns - avg) / 8);
+    WRITE_ONCE(dev->fg_last_ns, now);
+}
 
 /*
-* 1. Frees all the pages
+* 1. Account one operation of bytes that started at t0 (ktime_get_ns())
+* 2. Count, bytes, total and histogram bucket on this CPU
+* 3. Everything but faults is foreground I/O for the checkpoint throttle
 */
-static void asgn1_free_all_pages_locked(struct asgn1_dev *dev)
+static void asgn1_account(struct asgn1_dev *dev, enum asgn1_op op, u64 t0, size_t bytes)
+{
+    u64 now = ktime_get_ns(), ns = now - t0;
+
+    this_cpu_inc(dev->stats->ops[op]);
+    this_cpu_add(dev->stats->bytes[op], bytes);
+    this_cpu_add(dev->stats->lat_ns[op], ns);
+    this_cpu_inc(dev->stats->hist[op][min_t(int, fls64(ns), ASGN1_HIST_BUCKETS - 1)]);
+    if (op != ASGN1_OP_FAULT)
+        asgn1_fg_account(dev, ns, now);
+}
+
+// grow_lock, timing only the acquisitions that have to wait. Returns the wait
+static u64 asgn1_grow_lock(struct asgn1_dev *dev)
+{
+    u64 t0, ns;
+
+    if (mutex_trylock(&dev->grow_lock))
+        return 0;
+    t0 = ktime_get_ns();
+    mutex_lock(&dev->grow_lock);
+    ns = ktime_get_ns() - t0;
+    asgn1_stat_add(dev, ASGN1_STAT_GROW_WAITS, 1);
+    asgn1_stat_add(dev, ASGN1_STAT_GROW_WAIT_NS, ns);
+    return ns;
+}
+
+/* ---------- size and range lock fns ---------- */
+
+static inline size_t asgn1_size(struct asgn1_dev *dev)
+{
+    // Pairs with the fully ordered cmpxchg in asgn1_extend_size()
+    return (size_t)atomic_long_read_acquire(&dev->size_bytes);
+}
+
+/*
+* 1. Raise size_bytes to end, never lower it
+* 2. Concurrent writers race here, the largest end wins
+* 3. The winner wakes readers and pollers waiting at the old EOF, one
+*    wakeup per write rather than per page
+*/
+static void asgn1_extend_size(struct asgn1_dev *dev, size_t end)
 {
-    struct page_node *pn, *tmp;
+    long cur = atomic_long_read(&dev->size_bytes);
 
-    // Use tmp for safe delete while iteration
-    list_for_each_entry_safe(pn, tmp, &dev->pages, list) {
-        if (pn->page)
-            __free_page(pn->page);
+    while ((size_t)cur < end) {
+        if (atomic_long_try_cmpxchg(&dev->size_bytes, &cur, (long)end)) {
+            // wq_has_sleeper() orders the new size before the check
+            if (wq_has_sleeper(&dev->data_wq))
+                wake_up_interruptible_poll(&dev->data_wq, EPOLLIN | EPOLLRDNORM);
+            return;
+        }
+    }
+}
 
-	list_del(&pn->list);
+static bool asgn1_range_conflicts_locked(struct asgn1_dev *dev, struct asgn1_range *r)
+{
+    struct asgn1_range *held;
+    u64 walked = 0;
+    bool busy = false;
 
-        kfree(pn);
+    list_for_each_entry(held, &dev->ranges, node) {
+        walked++;
+        if (held->first <= r->last && r->first <= held->last &&
+            (held->excl || r->excl)) {
+            busy = true;
+            break;
+        }
     }
-    // Update the metadata
-    dev->size_bytes = 0;
+    asgn1_stat_add(dev, ASGN1_STAT_RANGE_LOCKS, 1);
+    asgn1_stat_add(dev, ASGN1_STAT_RANGE_WALKED, walked);
+    return busy;
+}
+
+static bool asgn1_range_trylock(struct asgn1_dev *dev, struct asgn1_range *r,
+                                pgoff_t first, pgoff_t last, bool excl)
+{
+    bool ok;
+
+    r->first = first;
+    r->last = last;
+    r->excl = excl;
+    r->wait_ns = 0;
+
+    spin_lock(&dev->range_lock);
+    ok = !asgn1_range_conflicts_locked(dev, r);
+    if (ok)
+        list_add(&r->node, &dev->ranges);
+    spin_unlock(&dev->range_lock);
+    return ok;
+}
+
+/*
+ * Lock the page range [first, last].
+ * 1. Shared holders only conflict with overlapping exclusive holders.
+ * 2. Sleeps until every conflicting holder has gone. No queueing order is
+ *    kept, so a steady stream of overlapping readers can delay a writer.
+ * 3. Only a wait is timed, the uncontended path costs no clock read.
+ */
+static void asgn1_range_lock(struct asgn1_dev *dev, struct asgn1_range *r,
+                             pgoff_t first, pgoff_t last, bool excl)
+{
+    u64 t0;
+
+    if (asgn1_range_trylock(dev, r, first, last, excl))
+        return;
+    t0 = ktime_get_ns();
+    wait_event(dev->range_wq, asgn1_range_trylock(dev, r, first, last, excl));
+    r->wait_ns = ktime_get_ns() - t0;
+    asgn1_stat_add(dev, ASGN1_STAT_RANGE_WAITS, 1);
+    asgn1_stat_add(dev, ASGN1_STAT_RANGE_WAIT_NS, r->wait_ns);
+}
+
+static void asgn1_range_unlock(struct asgn1_dev *dev, struct asgn1_range *r)
+{
+    spin_lock(&dev->range_lock);
+    list_del(&r->node);
+    spin_unlock(&dev->range_lock);
+
+    if (wq_has_sleeper(&dev->range_wq))
+        wake_up_all(&dev->range_wq);
 }
 
+/* ---------- page store manage fns ---------- */
+
 /*
- * Find the Nth page_node in the list.
- * 1. Traverse the doubly-linked list of pages from the beginning.
- * 2. Locate the node corresponding to the zero-based page_index.
- * 3. Return a pointer to the node on success, or NULL if the index is out of bounds.
+ * Can this page go to the recycle pool? Only order-0 pages nobody else
+ * holds (no pipe or GUP reference left), with room in the pool.
  */
-static struct page_node *asgn1_get_nth_page_locked(struct asgn1_dev *dev, size_t page_index)
+static bool asgn1_pool_wants(struct asgn1_dev *dev, struct page *page)
+{
+    return !PageCompound(page) && page_ref_count(page) == 1 &&
+           READ_ONCE(dev->numa_policy) == ASGN1_NUMA_LOCAL &&
+           READ_ONCE(dev->pool_nr) < READ_ONCE(dev->pool_max);
+}
+
+/*
+* 1. Move the pages on list (nr of them) into the pool, up to pool_max
+* 2. Whatever doesn't fit goes back to the page allocator
+*/
+static void asgn1_pool_fill(struct asgn1_dev *dev, struct list_head *list, unsigned long nr)
 {
-    size_t idx = 0;
-    struct page_node *pn;
+    struct page *page, *tmp;
+
+    spin_lock(&dev->pool_lock);
+    if (dev->pool_nr + nr <= dev->pool_max) {
+        list_splice_init(list, &dev->pool);
+        dev->pool_nr += nr;
+    } else {
+        list_for_each_entry_safe(page, tmp, list, lru) {
+            if (dev->pool_nr >= dev->pool_max)
+                break;
+            list_move(&page->lru, &dev->pool);
+            dev->pool_nr++;
+        }
+    }
+    spin_unlock(&dev->pool_lock);
 
-    list_for_each_entry(pn, &dev->pages, list) {
-        if (idx == page_index)
-            return pn;
-        idx++;
+    list_for_each_entry_safe(page, tmp, list, lru) {
+        list_del(&page->lru);
+        __free_page(page);
     }
-    return NULL;
 }
 
 /*
-* 1. Create/Ensure page for use
+* 1. Take up to nr pages off the pool onto list
+* 2. Returns how many were taken
 */
-static int asgn1_ensure_pages_locked(struct asgn1_dev *dev, size_t needed_pages)
+static unsigned long asgn1_pool_take(struct asgn1_dev *dev, struct list_head *list,
+                                     unsigned long nr)
 {
-    size_t have = 0;
-    struct page_node *pn;
+    unsigned long taken = 0;
 
-    list_for_each_entry(pn, &dev->pages, list)
-        have++;
+    spin_lock(&dev->pool_lock);
+    while (taken < nr && !list_empty(&dev->pool)) {
+        list_move(dev->pool.next, list);
+        taken++;
+    }
+    dev->pool_nr -= taken;
+    spin_unlock(&dev->pool_lock);
+    return taken;
+}
 
-    while (have < needed_pages) {
-	// Avoid random garbage value
-        pn = kzalloc(sizeof(*pn), GFP_KERNEL);
-        if (!pn)
-            return -ENOMEM;
-	// Create the actual page
-        pn->page = alloc_page(GFP_KERNEL);
-	// If unsuccessful
-        if (!pn->page) {
-            kfree(pn);
-            return -ENOMEM;
+static void asgn1_pool_drain(struct asgn1_dev *dev)
+{
+    struct page *page, *tmp;
+    LIST_HEAD(list);
+
+    asgn1_pool_take(dev, &list, ULONG_MAX);
+    list_for_each_entry_safe(page, tmp, &list, lru) {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+}
+
+/*
+* 1. The node the next store page should come from, NUMA_NO_NODE to
+*    leave it to the allocating task's policy
+* 2. BIND adds __GFP_THISNODE to gfp, it must not fall back
+*/
+static int asgn1_alloc_node(struct asgn1_dev *dev, gfp_t *gfp)
+{
+    int nid;
+
+    switch (READ_ONCE(dev->numa_policy)) {
+    case ASGN1_NUMA_INTERLEAVE:
+        // Racy without grow_lock (decompression), a node used twice is harmless
+        nid = next_node_in(READ_ONCE(dev->numa_next), node_states[N_MEMORY]);
+        WRITE_ONCE(dev->numa_next, nid);
+        return nid;
+    case ASGN1_NUMA_BIND:
+        *gfp |= __GFP_THISNODE;
+        return READ_ONCE(dev->numa_node);
+    default:
+        return NUMA_NO_NODE;
+    }
+}
+
+/*
+* 1. A zeroed order-0 page for the store, from the pool when it has one
+* 2. Pool pages hold old data, so they're cleared here
+*/
+static struct page *asgn1_alloc_page(struct asgn1_dev *dev)
+{
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+    struct page *page;
+    LIST_HEAD(list);
+    int nid;
+
+    nid = asgn1_alloc_node(dev, &gfp);
+    if (nid == NUMA_NO_NODE && READ_ONCE(dev->pool_nr) && asgn1_pool_take(dev, &list, 1)) {
+        page = list_first_entry(&list, struct page, lru);
+        list_del(&page->lru);
+        clear_highpage(page);
+        atomic_long_inc(&dev->pool_hits);
+        asgn1_stat_add(dev, ASGN1_STAT_PAGES_ALLOCATED, 1);
+        return page;
+    }
+
+    atomic_long_inc(&dev->pool_misses);
+    if (nid == NUMA_NO_NODE)
+        page = alloc_page(gfp);
+    else
+        page = alloc_pages_node(nid, gfp, 0);
+    if (page)
+        asgn1_stat_add(dev, ASGN1_STAT_PAGES_ALLOCATED, 1);
+    return page;
+}
+
+/*
+* 1. Fill pages[0, nr) with zeroed store pages, returns how many it got,
+*    fewer only when memory ran out
+* 2. Pool pages first, then one bulk call into the page allocator for the
+*    rest instead of one call per page
+* 3. Interleave goes page by page, a bulk call would put the batch on one node
+*/
+static unsigned long asgn1_alloc_pages(struct asgn1_dev *dev, struct page **pages,
+                                       unsigned long nr)
+{
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+    unsigned long got = 0, bulk;
+    struct page *page, *tmp;
+    LIST_HEAD(list);
+    int nid;
+
+    if (nr == 1 || READ_ONCE(dev->numa_policy) == ASGN1_NUMA_INTERLEAVE) {
+        for (; got < nr; got++) {
+            pages[got] = asgn1_alloc_page(dev);
+            if (!pages[got])
+                break;
+        }
+        return got;
+    }
+
+    nid = asgn1_alloc_node(dev, &gfp);
+    if (nid == NUMA_NO_NODE && READ_ONCE(dev->pool_nr)) {
+        got = asgn1_pool_take(dev, &list, nr);
+        list_for_each_entry_safe(page, tmp, &list, lru) {
+            list_del(&page->lru);
+            clear_highpage(page);
+            *pages++ = page;
         }
-        list_add_tail(&pn->list, &dev->pages);
-        have++;
+        atomic_long_add(got, &dev->pool_hits);
+    }
+
+    // The bulk allocator only fills NULL slots
+    memset(pages, 0, (nr - got) * sizeof(*pages));
+    bulk = nr > got ? asgn1_alloc_pages_bulk(gfp, nid, nr - got, pages) : 0;
+    atomic_long_add(nr - got, &dev->pool_misses);
+    got += bulk;
+
+    asgn1_stat_add(dev, ASGN1_STAT_PAGES_ALLOCATED, got);
+    return got;
+}
+
+/*
+ * Shrinker: under memory pressure the pool is the first thing to give up,
+ * it only holds free pages.
+ */
+static struct asgn1_dev *asgn1_shrinker_dev(struct shrinker *s)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    return s->private_data;
+#else
+    return container_of(s, struct asgn1_dev, shrinker);
+#endif
+}
+
+static unsigned long asgn1_pool_count(struct shrinker *s, struct shrink_control *sc)
+{
+    unsigned long nr = READ_ONCE(asgn1_shrinker_dev(s)->pool_nr);
+
+    return nr ? nr : SHRINK_EMPTY;
+}
+
+static unsigned long asgn1_pool_scan(struct shrinker *s, struct shrink_control *sc)
+{
+    struct asgn1_dev *dev = asgn1_shrinker_dev(s);
+    struct page *page, *tmp;
+    unsigned long taken;
+    LIST_HEAD(list);
+
+    taken = asgn1_pool_take(dev, &list, sc->nr_to_scan);
+    list_for_each_entry_safe(page, tmp, &list, lru) {
+        list_del(&page->lru);
+        __free_page(page);
     }
+    return taken ? taken : SHRINK_STOP;
+}
+
+static int asgn1_shrinker_register(struct asgn1_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    dev->shrinker = shrinker_alloc(0, DRV_NAME "-%d", dev->minor);
+    if (!dev->shrinker)
+        return -ENOMEM;
+    dev->shrinker->count_objects = asgn1_pool_count;
+    dev->shrinker->scan_objects = asgn1_pool_scan;
+    dev->shrinker->private_data = dev;
+    shrinker_register(dev->shrinker);
     return 0;
+#else
+    dev->shrinker.count_objects = asgn1_pool_count;
+    dev->shrinker.scan_objects = asgn1_pool_scan;
+    dev->shrinker.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(&dev->shrinker, DRV_NAME "-%d", dev->minor);
+#else
+    return register_shrinker(&dev->shrinker);
+#endif
+#endif
 }
 
-/* ---------- mmap support ---------- */
+static void asgn1_shrinker_unregister(struct asgn1_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(dev->shrinker);
+#else
+    unregister_shrinker(&dev->shrinker);
+#endif
+}
 
 /*
- * asgn1_vma_fault - VMA fault handler for mmap'd regions.
- * 1. Find the page in the device list corresponding to the fault offset.
- * 2. Verify the fault is within the device's size, return SIGBUS on error.
- * 3. Increment the page's refcount and assigns it to the VMF to be mapped.
+ * Drop the store's reference on a page leaving the store.
+ * 1. Huge extents are stored once per subpage, freed once via the head.
+ * 2. ->mapping was set when the page was first mmapped, the page
+ *    allocator refuses pages that still have one.
+ * 3. Order-0 pages go to the recycle pool when it wants them.
  */
-static vm_fault_t asgn1_vma_fault(struct vm_fault *vmf)
+static void asgn1_put_page(struct asgn1_dev *dev, struct page *page)
 {
-	struct page_node *pn;
-	size_t page_index = vmf->pgoff;
-	vm_fault_t ret = VM_FAULT_SIGBUS; /* Default error */
+    struct folio *folio;
 
-	mutex_lock(&gdev.lock);
+    if (PageTail(page))
+        return;
+    folio = page_folio(page);
+    folio->mapping = NULL;
+    asgn1_stat_add(dev, ASGN1_STAT_PAGES_FREED, folio_nr_pages(folio));
+    if (asgn1_pool_wants(dev, page)) {
+        LIST_HEAD(list);
 
-	/*
-	 * Check if the fault is within the logical size of the device.
-	 * The VMA may be larger than the current file size.
-	 */
-	if (page_index * PAGE_SIZE >= gdev.size_bytes) {
-		goto out;
-	}
+        list_add(&page->lru, &list);
+        asgn1_pool_fill(dev, &list, 1);
+        return;
+    }
+    folio_put(folio);
+}
 
-	pn = asgn1_get_nth_page_locked(&gdev, page_index);
-	if (!pn || !pn->page) {
-		goto out; /* Should not happen if size check is correct */
-	}
+static void asgn1_reset_store_locked(struct asgn1_dev *dev)
+{
+    WRITE_ONCE(dev->nr_pages, 0);
+    dev->end_index = 0;
+    atomic_long_set(&dev->nr_huge, 0);
+    atomic_long_set(&dev->nr_dirty, 0);
+    atomic_long_set(&dev->nr_compressed, 0);
+    atomic_long_set(&dev->compressed_bytes, 0);
+    atomic_long_set(&dev->nr_shared, 0);
+    atomic_long_set(&dev->size_bytes, 0);
+    WRITE_ONCE(dev->ckpt_full, true);
+}
 
-	get_page(pn->page); /* Increment page reference count before handing to MM */
-	vmf->page = pn->page;
-	ret = 0; /* Success (VM_FAULT_NOPAGE) */
+static inline bool asgn1_entry_is_zpage(void *entry)
+{
+    return xa_pointer_tag(entry) == ASGN1_TAG_ZPAGE;
+}
 
-out:
-	mutex_unlock(&gdev.lock);
-	return ret;
+static inline struct asgn1_zpage *asgn1_entry_zpage(void *entry)
+{
+    return xa_untag_pointer(entry);
 }
 
-static const struct vm_operations_struct asgn1_vm_ops = {
-	.fault = asgn1_vma_fault,
-};
+static inline bool asgn1_entry_is_shared(void *entry)
+{
+    return xa_pointer_tag(entry) == ASGN1_TAG_SHARED;
+}
 
-static int asgn1_mmap(struct file *filp, struct vm_area_struct *vma)
+static inline struct asgn1_shared *asgn1_entry_shared(void *entry)
 {
-	vma->vm_ops = &asgn1_vm_ops;
-	return 0;
+    return xa_untag_pointer(entry);
 }
 
-/* ---------- File ops related ---------- */
+// Drop one user of a shared page, true if it was the last one
+static bool asgn1_shared_put(struct asgn1_dev *dev, struct asgn1_shared *sh)
+{
+    if (!atomic_dec_and_test(&sh->users))
+        return false;
+    if (PageCompound(sh->page))
+        folio_put(page_folio(sh->page));
+    else
+        asgn1_put_page(dev, sh->page);
+    kfree(sh);
+    return true;
+}
 
 /*
-* 1. Open file, validate max concurrent users
+* 1. Zap every user mapping, so no one keeps writing to dropped pages
+* 2. Frees all the pages inline
+* 3. Drops the xarray nodes as well
+* 4. Caller holds the whole range exclusively
 */
-static int asgn1_open(struct inode *inode, struct file *filp)
+static void asgn1_free_all_pages_locked(struct asgn1_dev *dev)
+{
+    unsigned long index;
+    void *entry;
+
+    trace_asgn1_free_all(dev->minor, dev->nr_pages, 0);
+    if (dev->mapping)
+        unmap_mapping_range(dev->mapping, 0, 0, 1);
+
+    xa_for_each(dev->pages, index, entry) {
+        if (asgn1_entry_is_zpage(entry))
+            kfree(asgn1_entry_zpage(entry));
+        else if (asgn1_entry_is_shared(entry))
+            asgn1_shared_put(dev, asgn1_entry_shared(entry));
+        else
+            asgn1_put_page(dev, entry);
+    }
+    xa_destroy(dev->pages);
+
+    // Update the metadata
+    asgn1_reset_store_locked(dev);
+}
+
+/*
+ * Background reclaim of truncated stores, after PMR (OS-papers/PMR.md):
+ * truncate only detaches the old xarray, like PPS filling a victim list,
+ * and unbound workers free it in parallel. Each worker claims
+ * ASGN1_RECLAIM_CHUNK indices at a time off a shared cursor and frees the
+ * pages it finds with release_pages(), ASGN1_RECLAIM_BATCH at a time, so
+ * the zone lock is taken once per batch (the SPW batching idea). Pages the
+ * recycle pool wants go there instead, also a batch per lock hold. The last
+ * worker out destroys the xarray nodes and drops the instance ref.
+ */
+struct asgn1_reclaim;
+
+struct asgn1_reclaim_worker {
+    struct work_struct work;
+    struct asgn1_reclaim *rc;
+};
+
+struct asgn1_reclaim {
+    struct asgn1_dev *dev;
+    struct xarray *pages;           // detached, no one else sees it
+    unsigned long end;
+    atomic_long_t cursor;
+    atomic_t workers_left;
+    struct asgn1_reclaim_worker workers[];
+};
+
+static void asgn1_reclaim_fn(struct work_struct *work)
+{
+    struct asgn1_reclaim_worker *w = container_of(work, struct asgn1_reclaim_worker, work);
+    struct asgn1_reclaim *rc = w->rc;
+    struct asgn1_dev *dev = rc->dev;
+    struct page *batch[ASGN1_RECLAIM_BATCH];
+    unsigned long first, index, freed = 0, pooled = 0;
+    struct page *page;
+    LIST_HEAD(pool);
+    int n = 0;
+
+    while ((first = atomic_long_fetch_add(ASGN1_RECLAIM_CHUNK, &rc->cursor)) < rc->end) {
+        xa_for_each_range(rc->pages, index, page, first, first + ASGN1_RECLAIM_CHUNK - 1) {
+            struct folio *folio;
+
+            if (asgn1_entry_is_zpage(page)) {
+                kfree(asgn1_entry_zpage(page));
+                freed++;
+                continue;
+            }
+            if (asgn1_entry_is_shared(page)) {
+                asgn1_shared_put(dev, asgn1_entry_shared(page));
+                freed++;
+                continue;
+            }
+            if (PageTail(page))
+                continue;
+            folio = page_folio(page);
+            folio->mapping = NULL;
+            freed += folio_nr_pages(folio);
+            asgn1_stat_add(dev, ASGN1_STAT_PAGES_FREED, folio_nr_pages(folio));
+            if (asgn1_pool_wants(dev, page)) {
+                list_add(&page->lru, &pool);
+                pooled++;
+            } else {
+                batch[n++] = page;
+            }
+            if (n == ASGN1_RECLAIM_BATCH || pooled == ASGN1_RECLAIM_BATCH) {
+                release_pages(batch, n);
+                asgn1_pool_fill(dev, &pool, pooled);
+                atomic_long_sub(freed, &dev->reclaim_backlog);
+                n = 0;
+                pooled = 0;
+                freed = 0;
+                cond_resched();
+            }
+        }
+    }
+    if (n)
+        release_pages(batch, n);
+    if (pooled)
+        asgn1_pool_fill(dev, &pool, pooled);
+    atomic_long_sub(freed, &dev->reclaim_backlog);
+
+    if (atomic_dec_and_test(&rc->workers_left)) {
+        xa_destroy(rc->pages);
+        kfree(rc->pages);
+        kfree(rc);
+        kref_put(&dev->ref, asgn1_dev_release);
+    }
+}
+
+/*
+* 1. Truncate to zero without freeing anything in the caller
+* 2. Swap in an empty xarray, hand the old one to the reclaim workers
+* 3. Small stores, or no memory for the bookkeeping: free inline
+* 4. Caller holds the whole range exclusively
+*/
+static void asgn1_truncate_locked(struct asgn1_dev *dev)
+{
+    size_t nr = READ_ONCE(dev->nr_pages);
+    unsigned int i, nr_workers;
+    struct asgn1_reclaim *rc;
+    struct xarray *fresh;
+
+    if (nr < ASGN1_RECLAIM_INLINE)
+        goto inline_free;
+
+    nr_workers = min_t(unsigned long, num_online_cpus(),
+                       DIV_ROUND_UP(dev->end_index, ASGN1_RECLAIM_CHUNK));
+    fresh = kmalloc(sizeof(*fresh), GFP_KERNEL);
+    rc = kmalloc(struct_size(rc, workers, nr_workers), GFP_KERNEL);
+    if (!fresh || !rc) {
+        kfree(fresh);
+        kfree(rc);
+        goto inline_free;
+    }
+
+    if (dev->mapping)
+        unmap_mapping_range(dev->mapping, 0, 0, 1);
+
+    xa_init(fresh);
+    rc->dev = dev;
+    rc->pages = dev->pages;
+    rc->end = dev->end_index;
+    atomic_long_set(&rc->cursor, 0);
+    atomic_set(&rc->workers_left, nr_workers);
+    dev->pages = fresh;
+
+    atomic_long_add(nr, &dev->reclaim_backlog);
+    asgn1_reset_store_locked(dev);
+    trace_asgn1_truncate(dev->minor, nr, nr_workers);
+
+    kref_get(&dev->ref);
+    for (i = 0; i < nr_workers; i++) {
+        rc->workers[i].rc = rc;
+        INIT_WORK(&rc->workers[i].work, asgn1_reclaim_fn);
+        queue_work(asgn1_reclaim_wq, &rc->workers[i].work);
+    }
+    return;
+
+inline_free:
+    asgn1_free_all_pages_locked(dev);
+}
+
+/*
+* 1. Set ASGN1_MARK_DIRTY on a stored page, count it once
+* 2. Lockless fast path when the page is already dirty
+* 3. Clears ASGN1_MARK_INCOMPR, the data changed
+*/
+static void asgn1_mark_dirty(struct asgn1_dev *dev, pgoff_t index)
+{
+    // New contents, worth another compression attempt
+    if (xa_get_mark(dev->pages, index, ASGN1_MARK_INCOMPR))
+        xa_clear_mark(dev->pages, index, ASGN1_MARK_INCOMPR);
+
+    if (xa_get_mark(dev->pages, index, ASGN1_MARK_DIRTY))
+        return;
+
+    xa_lock(dev->pages);
+    if (xa_load(dev->pages, index) &&
+        !xa_get_mark(dev->pages, index, ASGN1_MARK_DIRTY)) {
+        __xa_set_mark(dev->pages, index, ASGN1_MARK_DIRTY);
+        atomic_long_inc(&dev->nr_dirty);
+    }
+    xa_unlock(dev->pages);
+}
+
+// Remember punched indices for the next checkpoint, a full one if we can't
+static void asgn1_ckpt_hole(struct asgn1_dev *dev, pgoff_t index, unsigned long nr)
+{
+    if (!dev->ckpt_file)
+        return;
+    while (nr--) {
+        if (xa_is_err(xa_store(&dev->ckpt_holes, index++, xa_mk_value(0), GFP_KERNEL))) {
+            WRITE_ONCE(dev->ckpt_full, true);
+            return;
+        }
+    }
+}
+
+/*
+ * Swap the compressed entry at index back for a real page.
+ * 1. Decompress into a fresh (or pooled) page, allocation must not fail:
+ *    the data exists nowhere else.
+ * 2. Readers share the range, so several may race on one index. The
+ *    xa_cmpxchg() winner frees the compressed copy, losers use its page.
+ */
+static struct page *asgn1_decompress_locked(struct asgn1_dev *dev, pgoff_t index, void *entry)
+{
+    struct asgn1_zpage *zp = asgn1_entry_zpage(entry);
+    u64 t0 = ktime_get_ns();
+    struct page *page;
+    void *old, *dst;
+    int n;
+
+    page = asgn1_alloc_page(dev);
+    if (!page) {
+        page = alloc_page(GFP_KERNEL | __GFP_NOFAIL);
+        asgn1_stat_add(dev, ASGN1_STAT_PAGES_ALLOCATED, 1);
+    }
+
+    dst = kmap_local_page(page);
+    n = LZ4_decompress_safe(zp->data, dst, zp->len, PAGE_SIZE);
+    kunmap_local(dst);
+    if (WARN_ON_ONCE(n != PAGE_SIZE))
+        clear_highpage(page);
+
+    // Replacing a present entry never allocates, so this can't fail
+    old = xa_cmpxchg(dev->pages, index, entry, page, GFP_KERNEL);
+    if (old != entry) {
+        asgn1_put_page(dev, page);
+        return old;
+    }
+
+    atomic_long_dec(&dev->nr_compressed);
+    atomic_long_sub(zp->len, &dev->compressed_bytes);
+    kfree(zp);
+    atomic_long_inc(&dev->decompressions);
+    atomic_long_add(ktime_get_ns() - t0, &dev->decompress_ns);
+    return page;
+}
+
+/*
+ * Find the page backing the given zero-based page_index, for an access.
+ * 1. Direct xarray lookup, O(log64 n) instead of a list walk.
+ * 2. Return the page on success, or NULL for a hole.
+ * 3. Compressed pages are decompressed first. With compression on, the
+ *    page is marked accessed for the cold scan.
+ * 4. Deduplicated pages are returned shared, read them only. Writers use
+ *    asgn1_get_nth_page_write_locked().
+ * 5. Caller holds page_index in its range lock, so the page can't go away.
+ */
+static struct page *asgn1_get_nth_page_locked(struct asgn1_dev *dev, size_t page_index)
+{
+    void *entry = xa_load(dev->pages, page_index);
+
+    if (!entry)
+        return NULL;
+    if (READ_ONCE(dev->compress_interval_ms) &&
+        !xa_get_mark(dev->pages, page_index, ASGN1_MARK_ACCESSED))
+        xa_set_mark(dev->pages, page_index, ASGN1_MARK_ACCESSED);
+    if (asgn1_entry_is_zpage(entry))
+        return asgn1_decompress_locked(dev, page_index, entry);
+    if (asgn1_entry_is_shared(entry))
+        return asgn1_entry_shared(entry)->page;
+    return entry;
+}
+
+/*
+ * The resident page at page_index, without touching it: NULL for holes,
+ * compressed and shared pages. For mapping neighbours and identity checks.
+ */
+static struct page *asgn1_peek_page_locked(struct asgn1_dev *dev, size_t page_index)
+{
+    void *entry = xa_load(dev->pages, page_index);
+
+    return entry && !xa_pointer_tag(entry) ? entry : NULL;
+}
+
+static bool asgn1_index_is_shared(struct asgn1_dev *dev, pgoff_t index)
+{
+    return asgn1_entry_is_shared(xa_load(dev->pages, index));
+}
+
+static bool asgn1_index_is_zpage(struct asgn1_dev *dev, pgoff_t index)
+{
+    return asgn1_entry_is_zpage(xa_load(dev->pages, index));
+}
+
+/*
+ * Give index its own page before a write (copy-on-write).
+ * 1. The last user takes the shared page back, everyone else copies it.
+ *    Huge subpages are always copied, the store only holds whole extents.
+ * 2. Under grow_lock like every store change, so write faults racing on
+ *    one index (they share the range) unshare it once.
+ * 3. Read-only mappings of the shared page at index are zapped, the next
+ *    fault maps the private page.
+ * Returns the page now at index, NULL if no copy could be allocated.
+ */
+static struct page *asgn1_unshare_locked(struct asgn1_dev *dev, pgoff_t index)
+{
+    struct asgn1_shared *sh;
+    struct page *page;
+    void *entry;
+
+    asgn1_grow_lock(dev);
+    entry = xa_load(dev->pages, index);
+    if (!asgn1_entry_is_shared(entry)) {
+        mutex_unlock(&dev->grow_lock);
+        return entry;
+    }
+    sh = asgn1_entry_shared(entry);
+
+    if (atomic_read(&sh->users) == 1 && !PageCompound(sh->page)) {
+        page = sh->page;
+    } else {
+        page = asgn1_alloc_page(dev);
+        if (!page) {
+            mutex_unlock(&dev->grow_lock);
+            return NULL;
+        }
+        copy_highpage(page, sh->page);
+    }
+
+    // Replacing a present entry never allocates
+    xa_store(dev->pages, index, page, GFP_KERNEL);
+    if (page == sh->page)
+        kfree(sh);
+    else
+        asgn1_shared_put(dev, sh);
+    atomic_long_dec(&dev->nr_shared);
+    atomic_long_inc(&dev->cow_breaks);
+    mutex_unlock(&dev->grow_lock);
+
+    if (dev->mapping)
+        unmap_mapping_range(dev->mapping, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, 0);
+    return page;
+}
+
+/*
+ * asgn1_get_nth_page_locked() for a caller about to modify the page.
+ * Shared pages are unshared first. NULL for a hole or out of memory.
+ */
+static struct page *asgn1_get_nth_page_write_locked(struct asgn1_dev *dev, pgoff_t index)
+{
+    struct page *page = asgn1_get_nth_page_locked(dev, index);
+
+    if (page && asgn1_index_is_shared(dev, index))
+        page = asgn1_unshare_locked(dev, index);
+    return page;
+}
+
+/*
+ * Fill the empty PMD sized extent starting at index start, which must be
+ * aligned.
+ * 1. Try a compound folio, without retrying hard or warning on failure.
+ * 2. Store every subpage at its own index, so lookups stay order-0.
+ * Returns -ENOMEM when the folio can't be had, caller falls back.
+ * Caller holds grow_lock.
+ */
+static int asgn1_grow_huge_locked(struct asgn1_dev *dev, pgoff_t start)
+{
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY;
+    struct folio *folio;
+    unsigned long i;
+    int rc = 0, nid;
+
+    nid = asgn1_alloc_node(dev, &gfp);
+    if (nid == NUMA_NO_NODE)
+        folio = folio_alloc(gfp, ASGN1_HPAGE_ORDER);
+    else
+        folio = __folio_alloc_node(gfp, ASGN1_HPAGE_ORDER, nid);
+    if (!folio)
+        return -ENOMEM;
+
+    for (i = 0; i < ASGN1_HPAGE_NR; i++) {
+        rc = xa_insert(dev->pages, start + i, folio_page(folio, i), GFP_KERNEL);
+        if (rc)
+            break;
+    }
+    if (rc) {
+        while (i--)
+            xa_erase(dev->pages, start + i);
+        folio_put(folio);
+        return rc;
+    }
+
+    WRITE_ONCE(dev->nr_pages, dev->nr_pages + ASGN1_HPAGE_NR);
+    dev->end_index = max_t(pgoff_t, dev->end_index, start + ASGN1_HPAGE_NR);
+    atomic_long_inc(&dev->nr_huge);
+    asgn1_stat_add(dev, ASGN1_STAT_PAGES_ALLOCATED, ASGN1_HPAGE_NR);
+    return 0;
+}
+
+static bool asgn1_extent_empty(struct asgn1_dev *dev, pgoff_t start)
+{
+    unsigned long index = start;
+
+    return !xa_find(dev->pages, &index, start + ASGN1_HPAGE_NR - 1, XA_PRESENT);
+}
+
+// Holes in [first, last], at most ASGN1_GROW_BATCH indices
+static unsigned long asgn1_count_holes(struct asgn1_dev *dev, pgoff_t first, pgoff_t last)
+{
+    unsigned long holes = 0;
+    pgoff_t index;
+
+    for (index = first; index <= last; index++)
+        if (!xa_load(dev->pages, index))
+            holes++;
+    return holes;
+}
+
+/*
+* 1. Create/Ensure a page at every index in [first, last]
+* 2. The store is sparse, indices outside the range stay holes
+* 3. Store changes are serialized by grow_lock, the all-present case is lockless
+* 4. In huge mode a hole in an empty extent gets the whole extent, which may
+*    reach outside [first, last]. Those pages are zeroed, so anyone holding
+*    them in the range lock still reads the zeros they saw as a hole.
+* 5. Pages come zeroed, they can be mapped into user space before written
+* 6. Holes are filled from batches of up to ASGN1_GROW_BATCH pages, sized to
+*    the holes left in the next ASGN1_GROW_BATCH indices
+*/
+static int asgn1_ensure_range_locked(struct asgn1_dev *dev, pgoff_t first, pgoff_t last)
+{
+    struct page *batch[ASGN1_GROW_BATCH];
+    unsigned long nr = 0, next = 0;
+    size_t nr_before;
+    struct page *page;
+    pgoff_t index;
+    u64 wait_ns;
+    int rc = 0;
+
+    for (index = first; index <= last; index++) {
+        if (!xa_load(dev->pages, index))
+            break;
+    }
+    if (index > last)
+        return 0;
+
+    wait_ns = asgn1_grow_lock(dev);
+    nr_before = dev->nr_pages;
+    for (; index <= last; index++) {
+        if (xa_load(dev->pages, index))
+            continue;
+
+        if (READ_ONCE(dev->huge)) {
+            pgoff_t start = ALIGN_DOWN(index, ASGN1_HPAGE_NR);
+
+            if (asgn1_extent_empty(dev, start)) {
+                if (!asgn1_grow_huge_locked(dev, start))
+                    continue;
+                atomic_long_inc(&dev->huge_alloc_fails);
+            }
+        }
+
+	// Create the actual page
+        if (next == nr) {
+            pgoff_t end = min_t(pgoff_t, last, index + ASGN1_GROW_BATCH - 1);
+
+            // In huge mode the next extent may get a folio, stop at this one
+            if (READ_ONCE(dev->huge))
+                end = min_t(pgoff_t, end, ALIGN_DOWN(index, ASGN1_HPAGE_NR) + ASGN1_HPAGE_NR - 1);
+            next = 0;
+            nr = asgn1_alloc_pages(dev, batch, asgn1_count_holes(dev, index, end));
+            if (!nr) {
+                rc = -ENOMEM;
+                break;
+            }
+        }
+        page = batch[next++];
+
+        rc = xa_insert(dev->pages, index, page, GFP_KERNEL);
+        if (rc) {
+            __free_page(page);
+            break;
+        }
+        WRITE_ONCE(dev->nr_pages, dev->nr_pages + 1);
+        dev->end_index = max_t(pgoff_t, dev->end_index, index + 1);
+    }
+    // Left over after an error
+    if (next < nr)
+        asgn1_stat_add(dev, ASGN1_STAT_PAGES_FREED, nr - next);
+    while (next < nr)
+        __free_page(batch[next++]);
+    trace_asgn1_alloc(dev->minor, first, last, dev->nr_pages - nr_before, wait_ns, rc);
+    mutex_unlock(&dev->grow_lock);
+    return rc;
+}
+
+/*
+* 1. Remove [first, last] from the store, leaving holes
+* 2. A huge extent is only freed when the whole extent is inside the range,
+*    its other pages are zeroed in place instead
+* 3. Caller holds [first, last] exclusively and has unmapped it
+*/
+static void asgn1_punch_pages_locked(struct asgn1_dev *dev, pgoff_t first, pgoff_t last)
+{
+    struct page *page;
+    unsigned long index;
+
+    asgn1_grow_lock(dev);
+    xa_for_each_range(dev->pages, index, page, first, last) {
+        struct folio *folio;
+        unsigned long nr, i;
+
+        if (asgn1_entry_is_zpage(page)) {
+            struct asgn1_zpage *zp = asgn1_entry_zpage(page);
+
+            if (xa_get_mark(dev->pages, index, ASGN1_MARK_DIRTY))
+                atomic_long_dec(&dev->nr_dirty);
+            xa_erase(dev->pages, index);
+            asgn1_ckpt_hole(dev, index, 1);
+            WRITE_ONCE(dev->nr_pages, dev->nr_pages - 1);
+            atomic_long_dec(&dev->nr_compressed);
+            atomic_long_sub(zp->len, &dev->compressed_bytes);
+            kfree(zp);
+            continue;
+        }
+        if (asgn1_entry_is_shared(page)) {
+            if (xa_get_mark(dev->pages, index, ASGN1_MARK_DIRTY))
+                atomic_long_dec(&dev->nr_dirty);
+            xa_erase(dev->pages, index);
+            asgn1_ckpt_hole(dev, index, 1);
+            WRITE_ONCE(dev->nr_pages, dev->nr_pages - 1);
+            asgn1_shared_put(dev, asgn1_entry_shared(page));
+            atomic_long_dec(&dev->nr_shared);
+            continue;
+        }
+
+        folio = page_folio(page);
+        nr = folio_nr_pages(folio);
+
+        if (nr > 1 && (!PageHead(page) || index + nr - 1 > last)) {
+            memzero_page(page, 0, PAGE_SIZE);
+            asgn1_mark_dirty(dev, index);
+            continue;
+        }
+
+        for (i = 0; i < nr; i++) {
+            if (xa_get_mark(dev->pages, index + i, ASGN1_MARK_DIRTY))
+                atomic_long_dec(&dev->nr_dirty);
+            xa_erase(dev->pages, index + i);
+        }
+        asgn1_ckpt_hole(dev, index, nr);
+        WRITE_ONCE(dev->nr_pages, dev->nr_pages - nr);
+        if (nr > 1)
+            atomic_long_dec(&dev->nr_huge);
+        asgn1_put_page(dev, page);
+        index += nr - 1;
+    }
+    mutex_unlock(&dev->grow_lock);
+}
+
+/*
+* 1. Replace one cold page with its LZ4 copy
+* 2. Caller holds index exclusively and checked nobody maps or pins it
+*/
+static void asgn1_compress_page_locked(struct asgn1_dev *dev, pgoff_t index,
+                                       struct page *page, void *wrkmem, char *buf)
+{
+    struct asgn1_zpage *zp;
+    void *src;
+    int len;
+
+    src = kmap_local_page(page);
+    len = LZ4_compress_default(src, buf, PAGE_SIZE, LZ4_COMPRESSBOUND(PAGE_SIZE), wrkmem);
+    kunmap_local(src);
+    if (len <= 0 || len > ASGN1_COMPRESS_MAX) {
+        xa_set_mark(dev->pages, index, ASGN1_MARK_INCOMPR);
+        return;
+    }
+
+    zp = kmalloc(struct_size(zp, data, len), GFP_KERNEL | __GFP_NOWARN);
+    if (!zp)
+        return;
+    zp->len = len;
+    memcpy(zp->data, buf, len);
+
+    // Replacing a present entry keeps its marks and never allocates
+    if (xa_is_err(xa_store(dev->pages, index, xa_tag_pointer(zp, ASGN1_TAG_ZPAGE),
+                           GFP_KERNEL))) {
+        kfree(zp);
+        return;
+    }
+    atomic_long_inc(&dev->nr_compressed);
+    atomic_long_add(len, &dev->compressed_bytes);
+    asgn1_put_page(dev, page);
+}
+
+/*
+ * asgn1_compress_fn - The cold page scan, every compress_interval_ms.
+ * 1. Walk the store ASGN1_COMPRESS_CHUNK indices at a time, each chunk
+ *    only if it can be held exclusively right now.
+ * 2. Accessed pages lose their mark and stay. Unmarked order-0 pages that
+ *    nothing maps or pins get compressed.
+ * 3. The first pass after turning compression on only starts the marks.
+ */
+static void asgn1_compress_fn(struct work_struct *work)
+{
+    struct asgn1_dev *dev = container_of(to_delayed_work(work), struct asgn1_dev,
+                                         compress_work);
+    unsigned int interval = READ_ONCE(dev->compress_interval_ms);
+    bool primed = dev->compress_primed;
+    unsigned long start, index;
+    struct page *page;
+    void *wrkmem;
+    char *buf;
+
+    if (!interval)
+        return;
+
+    wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    buf = kmalloc(LZ4_COMPRESSBOUND(PAGE_SIZE), GFP_KERNEL);
+    if (!wrkmem || !buf)
+        goto out;
+
+    for (start = 0; start < READ_ONCE(dev->end_index); start += ASGN1_COMPRESS_CHUNK) {
+        struct asgn1_range r;
+
+        if (!asgn1_range_trylock(dev, &r, start, start + ASGN1_COMPRESS_CHUNK - 1, true))
+            continue;
+
+        xa_for_each_range(dev->pages, index, page, start, start + ASGN1_COMPRESS_CHUNK - 1) {
+            if (xa_pointer_tag(page))
+                continue;
+            if (xa_get_mark(dev->pages, index, ASGN1_MARK_ACCESSED)) {
+                xa_clear_mark(dev->pages, index, ASGN1_MARK_ACCESSED);
+                continue;
+            }
+            if (!primed || PageCompound(page) || folio_mapped(page_folio(page)) ||
+                page_ref_count(page) != 1 ||
+                xa_get_mark(dev->pages, index, ASGN1_MARK_INCOMPR))
+                continue;
+            asgn1_compress_page_locked(dev, index, page, wrkmem, buf);
+        }
+
+        asgn1_range_unlock(dev, &r);
+        cond_resched();
+    }
+    dev->compress_primed = true;
+
+out:
+    kvfree(wrkmem);
+    kfree(buf);
+    queue_delayed_work(system_unbound_wq, &dev->compress_work, msecs_to_jiffies(interval));
+}
+
+// The page behind a store entry if the dedup scan may merge it, else NULL
+static struct page *asgn1_dedup_target(void *entry)
+{
+    struct page *page = entry;
+
+    if (!entry || asgn1_entry_is_zpage(entry))
+        return NULL;
+    if (asgn1_entry_is_shared(entry))
+        return asgn1_entry_shared(entry)->page;
+    if (PageCompound(page) || folio_mapped(page_folio(page)) || page_ref_count(page) != 1)
+        return NULL;
+    return page;
+}
+
+/*
+* 1. Make the plain page at index share the page stored at keep
+* 2. A plain page at keep becomes shared first, a shared one gains a user
+* 3. Caller holds both indices exclusively and compared their contents
+*/
+static void asgn1_dedup_merge_locked(struct asgn1_dev *dev, pgoff_t index, pgoff_t keep)
+{
+    struct page *page = xa_load(dev->pages, index);
+    void *entry = xa_load(dev->pages, keep);
+    struct asgn1_shared *sh;
+
+    asgn1_grow_lock(dev);
+    if (asgn1_entry_is_shared(entry)) {
+        sh = asgn1_entry_shared(entry);
+        atomic_inc(&sh->users);
+    } else {
+        sh = kmalloc(sizeof(*sh), GFP_KERNEL | __GFP_NOWARN);
+        if (!sh) {
+            mutex_unlock(&dev->grow_lock);
+            return;
+        }
+        sh->page = entry;
+        atomic_set(&sh->users, 2);
+        // Unmapped (checked), and from now on only mapped read-only
+        page_folio(sh->page)->mapping = NULL;
+        xa_store(dev->pages, keep, xa_tag_pointer(sh, ASGN1_TAG_SHARED), GFP_KERNEL);
+        atomic_long_inc(&dev->nr_shared);
+    }
+    xa_store(dev->pages, index, xa_tag_pointer(sh, ASGN1_TAG_SHARED), GFP_KERNEL);
+    mutex_unlock(&dev->grow_lock);
+
+    atomic_long_inc(&dev->nr_shared);
+    asgn1_put_page(dev, page);
+}
+
+/*
+ * Merge index and cidx if they hold the same bytes, a hash match is only
+ * a hint. index is inside the chunk the scan holds, starting at start,
+ * cidx is tried exclusively unless it is too. At most one of the two may
+ * already be shared, that one is kept. Returns true if they were merged.
+ */
+static bool asgn1_dedup_try_merge(struct asgn1_dev *dev, pgoff_t index, pgoff_t cidx,
+                                  pgoff_t start)
+{
+    bool outside = cidx < start || cidx >= start + ASGN1_DEDUP_CHUNK;
+    void *entry, *centry;
+    struct page *a, *b;
+    struct asgn1_range r;
+    bool same = false;
+    void *pa, *pb;
+
+    if (outside && !asgn1_range_trylock(dev, &r, cidx, cidx, true))
+        return false;
+
+    entry = xa_load(dev->pages, index);
+    centry = xa_load(dev->pages, cidx);
+    a = asgn1_dedup_target(entry);
+    b = asgn1_dedup_target(centry);
+    if (a && b && a != b && !(asgn1_entry_is_shared(entry) && asgn1_entry_is_shared(centry))) {
+        pa = kmap_local_page(a);
+        pb = kmap_local_page(b);
+        same = !memcmp(pa, pb, PAGE_SIZE);
+        kunmap_local(pb);
+        kunmap_local(pa);
+    }
+    if (same) {
+        if (asgn1_entry_is_shared(entry))
+            asgn1_dedup_merge_locked(dev, cidx, index);
+        else
+            asgn1_dedup_merge_locked(dev, index, cidx);
+    }
+
+    if (outside)
+        asgn1_range_unlock(dev, &r);
+    return same;
+}
+
+/*
+* 1. Dedup one entry of the chunk the scan holds exclusively
+* 2. All-zero pages are punched, the hole reads as zeros
+* 3. Otherwise look for an earlier page of this sweep with the same hash,
+*    pages without a match are remembered for the rest of the sweep
+*/
+static void asgn1_dedup_page_locked(struct asgn1_dev *dev, pgoff_t index, void *entry,
+                                    pgoff_t start)
+{
+    struct page *page = asgn1_dedup_target(entry);
+    struct asgn1_dedup_node *dn;
+    struct hlist_head *bucket;
+    void *kaddr;
+    bool zero;
+    u64 hash;
+
+    if (!page)
+        return;
+
+    // Shared pages were hashed non-zero when they were merged
+    kaddr = kmap_local_page(page);
+    zero = !asgn1_entry_is_shared(entry) && !memchr_inv(kaddr, 0, PAGE_SIZE);
+    hash = zero ? 0 : xxh64(kaddr, PAGE_SIZE, 0);
+    kunmap_local(kaddr);
+
+    if (zero) {
+        // Preallocated and not written yet, see asgn1_prealloc()
+        if (xa_get_mark(dev->pages, index, ASGN1_MARK_INCOMPR))
+            return;
+        asgn1_punch_pages_locked(dev, index, index);
+        atomic_long_inc(&dev->zero_pages);
+        return;
+    }
+
+    bucket = &dev->dedup_table[hash & (dev->dedup_buckets - 1)];
+    hlist_for_each_entry(dn, bucket, node) {
+        if (dn->hash == hash && dn->index != index &&
+            asgn1_dedup_try_merge(dev, index, dn->index, start))
+            return;
+    }
+
+    if (dev->dedup_nodes >= ASGN1_DEDUP_NODES_MAX)
+        return;
+    dn = kmalloc(sizeof(*dn), GFP_KERNEL | __GFP_NOWARN);
+    if (!dn)
+        return;
+    dn->hash = hash;
+    dn->index = index;
+    hlist_add_head(&dn->node, bucket);
+    dev->dedup_nodes++;
+}
+
+// Forget the hashes of the current sweep
+static void asgn1_dedup_reset(struct asgn1_dev *dev)
+{
+    struct asgn1_dedup_node *dn;
+    struct hlist_node *tmp;
+    unsigned long i;
+
+    if (!dev->dedup_table)
+        return;
+    for (i = 0; i < dev->dedup_buckets; i++) {
+        hlist_for_each_entry_safe(dn, tmp, &dev->dedup_table[i], node)
+            kfree(dn);
+        if (!(i & 4095))
+            cond_resched();
+    }
+    kvfree(dev->dedup_table);
+    dev->dedup_table = NULL;
+    dev->dedup_nodes = 0;
+    dev->dedup_cursor = 0;
+}
+
+/*
+ * asgn1_dedup_fn - The dedup scan, every dedup_interval_ms.
+ * 1. Resume at dedup_cursor and look at about dedup_pages stored pages,
+ *    a chunk at a time, each chunk only if it can be held exclusively now.
+ * 2. Runs of holes are skipped with one lookup. That lookup, and a chunk
+ *    that was busy, cost one page of budget too, so a sparse or contended
+ *    image can't keep a run going. The rest waits for the next interval.
+ * 3. Only order-0 pages nothing maps or pins are merged or punched.
+ * 4. A sweep ends at end_index, the next one starts with an empty table
+ *    sized for the store as it is then.
+ */
+static void asgn1_dedup_fn(struct work_struct *work)
+{
+    struct asgn1_dev *dev = container_of(to_delayed_work(work), struct asgn1_dev,
+                                         dedup_work);
+    unsigned int interval = READ_ONCE(dev->dedup_interval_ms);
+    long budget = READ_ONCE(dev->dedup_pages);
+    unsigned long index;
+    void *entry;
+
+    if (!interval)
+        return;
+
+    while (budget > 0) {
+        pgoff_t start = dev->dedup_cursor;
+        pgoff_t end = READ_ONCE(dev->end_index);
+        unsigned long next = start;
+        struct asgn1_range r;
+
+        budget--;
+        // Jump to the chunk of the next stored page, shared so truncate can't swap the store
+        if (start < end && asgn1_range_trylock(dev, &r, start, end - 1, false)) {
+            if (!xa_find(dev->pages, &next, end - 1, XA_PRESENT))
+                next = end;
+            asgn1_range_unlock(dev, &r);
+            start = next < end ? round_down(next, ASGN1_DEDUP_CHUNK) : end;
+        }
+
+        if (start >= end) {
+            if (start)
+                atomic_long_inc(&dev->dedup_scans);
+            asgn1_dedup_reset(dev);
+            break;
+        }
+        if (!dev->dedup_table) {
+            // Sized once per sweep, a store that grows meanwhile gets longer chains
+            dev->dedup_buckets = clamp_t(unsigned long, roundup_pow_of_two(READ_ONCE(dev->end_index)),
+                                         ASGN1_DEDUP_BUCKETS_MIN, ASGN1_DEDUP_BUCKETS_MAX);
+            dev->dedup_table = kvcalloc(dev->dedup_buckets, sizeof(*dev->dedup_table),
+                                        GFP_KERNEL);
+            if (!dev->dedup_table)
+                break;
+        }
+        dev->dedup_cursor = start + ASGN1_DEDUP_CHUNK;
+
+        if (!asgn1_range_trylock(dev, &r, start, start + ASGN1_DEDUP_CHUNK - 1, true))
+            continue;
+        xa_for_each_range(dev->pages, index, entry, start, start + ASGN1_DEDUP_CHUNK - 1) {
+            asgn1_dedup_page_locked(dev, index, entry, start);
+            budget--;
+        }
+        asgn1_range_unlock(dev, &r);
+        cond_resched();
+    }
+
+    queue_delayed_work(system_unbound_wq, &dev->dedup_work, msecs_to_jiffies(interval));
+}
+
+/*
+* 1. SEEK_DATA/SEEK_HOLE: next stored page or next hole at or after off
+* 2. EOF counts as a hole, off at or past EOF is -ENXIO
+* 3. Holds [off, end] shared, truncate can't swap the store out meanwhile
+*/
+static loff_t asgn1_seek_data_hole(struct asgn1_dev *dev, loff_t off, int whence)
+{
+    loff_t size = asgn1_size(dev);
+    unsigned long index = off >> PAGE_SHIFT, expect = index;
+    struct asgn1_range r;
+    struct page *page;
+    loff_t found;
+
+    if (off < 0 || off >= size)
+        return -ENXIO;
+
+    asgn1_range_lock(dev, &r, index, ASGN1_RANGE_ALL, false);
+    size = asgn1_size(dev);
+    if (off >= size) {
+        found = -ENXIO;
+    } else if (whence == SEEK_DATA) {
+        found = -ENXIO;
+        if (xa_find(dev->pages, &index, ULONG_MAX, XA_PRESENT)) {
+            found = max_t(loff_t, off, (loff_t)index << PAGE_SHIFT);
+            if (found >= size)
+                found = -ENXIO;
+        }
+    } else {
+        // SEEK_HOLE: walk the run of stored pages starting at off
+        xa_for_each_start(dev->pages, index, page, expect) {
+            if (index != expect)
+                break;
+            expect++;
+            cond_resched();
+        }
+        found = max_t(loff_t, off, (loff_t)expect << PAGE_SHIFT);
+        found = min_t(loff_t, found, size);
+    }
+    asgn1_range_unlock(dev, &r);
+    return found;
+}
+
+/* ---------- checkpoint and restore ---------- */
+
+static inline loff_t asgn1_ckpt_pos(pgoff_t index)
+{
+    return ((loff_t)index + 1) << PAGE_SHIFT;
+}
+
+/*
+ * Yield to foreground I/O, after SILK (OS-papers/SILK.md): the checkpoint
+ * is the background task, reads and writes the foreground one.
+ * 1. While reads and writes are running slower than checkpoint_budget_us,
+ *    sleep, 1 ms doubling up to 64 ms.
+ * 2. Idle foreground (nothing for ASGN1_FG_IDLE_NS) never waits, and a
+ *    batch waits ASGN1_CKPT_STALL_MAX ms at most, so checkpoints finish.
+ */
+static void asgn1_ckpt_throttle(struct asgn1_dev *dev)
+{
+    unsigned int ms = 1, waited = 0;
+
+    while (waited < ASGN1_CKPT_STALL_MAX) {
+        u64 budget = (u64)READ_ONCE(dev->ckpt_budget_us) * NSEC_PER_USEC;
+
+        if (!budget || ktime_get_ns() - READ_ONCE(dev->fg_last_ns) > ASGN1_FG_IDLE_NS ||
+            atomic_long_read(&dev->fg_lat_ns) <= (long)budget)
+            return;
+        atomic_long_inc(&dev->ckpt_throttled);
+        msleep(ms);
+        waited += ms;
+        ms = min(ms * 2, 64U);
+    }
+}
+
+// Write nr pages from bv to the image, starting at store index
+static int asgn1_ckpt_write(struct asgn1_dev *dev, struct bio_vec *bv, unsigned int nr,
+                            pgoff_t index)
+{
+    size_t len = (size_t)nr << PAGE_SHIFT;
+    loff_t pos = asgn1_ckpt_pos(index);
+    struct iov_iter iter;
+    ssize_t n;
+
+    iov_iter_bvec(&iter, ITER_SOURCE, bv, nr, len);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+    file_start_write(dev->ckpt_file);
+    n = vfs_iter_write(dev->ckpt_file, &iter, &pos, 0);
+    file_end_write(dev->ckpt_file);
+#else
+    n = vfs_iter_write(dev->ckpt_file, &iter, &pos, 0);
+#endif
+    if (n < 0)
+        return n;
+    return n == len ? 0 : -EIO;
+}
+
+// Copy one store entry's contents, whatever form it is in
+static void asgn1_ckpt_copy(struct page *dst, void *entry)
+{
+    if (asgn1_entry_is_zpage(entry)) {
+        struct asgn1_zpage *zp = asgn1_entry_zpage(entry);
+        void *to = kmap_local_page(dst);
+        int n = LZ4_decompress_safe(zp->data, to, zp->len, PAGE_SIZE);
+
+        kunmap_local(to);
+        if (WARN_ON_ONCE(n != PAGE_SIZE))
+            clear_highpage(dst);
+    } else if (asgn1_entry_is_shared(entry)) {
+        copy_highpage(dst, asgn1_entry_shared(entry)->page);
+    } else {
+        copy_highpage(dst, entry);
+    }
+}
+
+/*
+ * Checkpoint the ASGN1_CKPT_BATCH indices from start, only the dirty ones
+ * unless full.
+ * 1. Held exclusively while the pages are picked: dirty mark cleared,
+ *    mappings write protected with folio_mkclean(), so the next store
+ *    through mmap takes page_mkwrite and marks the page again, then the
+ *    contents copied out to ck->stage. Stores that beat folio_mkclean()
+ *    are in the copy.
+ * 2. A stale hole record for a copied index is dropped, the data wins.
+ * 3. Written after unlocking, one vfs_iter_write() per contiguous run.
+ */
+static int asgn1_ckpt_batch(struct asgn1_dev *dev, struct asgn1_ckpt *ck, pgoff_t start,
+                            bool full)
+{
+    pgoff_t last = start + ASGN1_CKPT_BATCH - 1;
+    struct folio *cleaned = NULL;
+    unsigned int n = 0, i, run;
+    struct asgn1_range r;
+    unsigned long index;
+    void *entry;
+    int rc = 0;
+
+    asgn1_range_lock(dev, &r, start, last, true);
+    xa_for_each_range(dev->pages, index, entry, start, last) {
+        if (xa_get_mark(dev->pages, index, ASGN1_MARK_DIRTY)) {
+            xa_clear_mark(dev->pages, index, ASGN1_MARK_DIRTY);
+            atomic_long_dec(&dev->nr_dirty);
+        } else if (!full) {
+            continue;
+        }
+
+        // Huge extents are one folio, write protect it once
+        if (!xa_pointer_tag(entry) && page_folio(entry) != cleaned &&
+            folio_mapped(page_folio(entry))) {
+            cleaned = page_folio(entry);
+            folio_lock(cleaned);
+            folio_mkclean(cleaned);
+            folio_unlock(cleaned);
+        }
+
+        asgn1_ckpt_copy(ck->stage[n], entry);
+        if (!xa_empty(&dev->ckpt_holes))
+            xa_erase(&dev->ckpt_holes, index);
+        ck->index[n++] = index;
+    }
+    asgn1_range_unlock(dev, &r);
+
+    for (i = 0; i < n && !rc; i += run) {
+        for (run = 0; i + run < n && ck->index[i + run] == ck->index[i] + run; run++) {
+            ck->bv[run].bv_page = ck->stage[i + run];
+            ck->bv[run].bv_len = PAGE_SIZE;
+            ck->bv[run].bv_offset = 0;
+        }
+        rc = asgn1_ckpt_write(dev, ck->bv, run, ck->index[i]);
+    }
+    atomic_long_add(n, &dev->ckpt_pages);
+    return rc ? rc : n;
+}
+
+// First index at or after *index a checkpoint wants, false when there is none
+static bool asgn1_ckpt_next(struct asgn1_dev *dev, unsigned long *index, bool full)
+{
+    struct asgn1_range r;
+    void *entry;
+
+    // Truncate can't swap the store out while the rest of it is held
+    asgn1_range_lock(dev, &r, *index, ASGN1_RANGE_ALL, false);
+    entry = xa_find(dev->pages, index, ULONG_MAX, full ? XA_PRESENT : ASGN1_MARK_DIRTY);
+    asgn1_range_unlock(dev, &r);
+    return entry;
+}
+
+/*
+ * Punch the recorded holes into the image, a run of indices per call.
+ * A run is forgotten before it is punched, an index punched again
+ * meanwhile stays recorded for the next checkpoint.
+ */
+static int asgn1_ckpt_holes(struct asgn1_dev *dev)
+{
+    unsigned long index = 0, last;
+    int rc;
+
+    while (xa_find(&dev->ckpt_holes, &index, ULONG_MAX, XA_PRESENT)) {
+        xa_erase(&dev->ckpt_holes, index);
+        for (last = index; last < ULONG_MAX && xa_erase(&dev->ckpt_holes, last + 1); last++)
+            ;
+        rc = vfs_fallocate(dev->ckpt_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           asgn1_ckpt_pos(index), (loff_t)(last - index + 1) << PAGE_SHIFT);
+        if (rc)
+            return rc;
+        if (last == ULONG_MAX)
+            break;
+        index = last + 1;
+        cond_resched();
+    }
+    return 0;
+}
+
+static int asgn1_ckpt_write_hdr(struct asgn1_dev *dev, size_t size)
+{
+    struct asgn1_ckpt_hdr hdr = {
+        .version    = cpu_to_le32(ASGN1_CKPT_VERSION),
+        .page_size  = cpu_to_le32(PAGE_SIZE),
+        .size_bytes = cpu_to_le64(size),
+    };
+    loff_t pos = 0;
+    ssize_t n;
+
+    memcpy(hdr.magic, ASGN1_CKPT_MAGIC, sizeof(hdr.magic));
+    n = kernel_write(dev->ckpt_file, &hdr, sizeof(hdr), &pos);
+    if (n < 0)
+        return n;
+    return n == sizeof(hdr) ? 0 : -EIO;
+}
+
+/*
+* 1. Zero the header's magic and make that durable, before a checkpoint
+*    changes the image in place
+* 2. A crash or error before the new header is written leaves an image
+*    restore refuses, never the old header over half-written data
+*/
+static int asgn1_ckpt_invalidate(struct asgn1_dev *dev)
+{
+    char magic[sizeof_field(struct asgn1_ckpt_hdr, magic)] = {};
+    loff_t pos = 0;
+    ssize_t n;
+
+    n = kernel_write(dev->ckpt_file, magic, sizeof(magic), &pos);
+    if (n < 0)
+        return n;
+    if (n != sizeof(magic))
+        return -EIO;
+    return vfs_fsync(dev->ckpt_file, 0);
+}
+
+static struct asgn1_ckpt *asgn1_ckpt_alloc(bool stage)
+{
+    struct asgn1_ckpt *ck = kzalloc(sizeof(*ck), GFP_KERNEL);
+    int i;
+
+    if (!ck || !stage)
+        return ck;
+    for (i = 0; i < ASGN1_CKPT_BATCH; i++) {
+        ck->stage[i] = alloc_page(GFP_KERNEL);
+        if (!ck->stage[i])
+            goto err;
+    }
+    return ck;
+
+err:
+    while (--i >= 0)
+        __free_page(ck->stage[i]);
+    kfree(ck);
+    return NULL;
+}
+
+static void asgn1_ckpt_free(struct asgn1_ckpt *ck)
+{
+    int i;
+
+    for (i = 0; i < ASGN1_CKPT_BATCH; i++)
+        if (ck->stage[i])
+            __free_page(ck->stage[i]);
+    kfree(ck);
+}
+
+/*
+ * asgn1_checkpoint - Bring the image up to date with the store.
+ * 1. ckpt_full (new image, truncate, an earlier failure): cut the image
+ *    back to its header and write every stored page. Otherwise punch the
+ *    recorded holes, then write the pages dirtied since the last one.
+ * 2. ASGN1_CKPT_BATCH indices at a time, see asgn1_ckpt_batch(). With
+ *    throttle, each batch first yields to busy foreground I/O.
+ * 3. Before anything is rewritten the old header is invalidated, see
+ *    asgn1_ckpt_invalidate(). The new header goes last, then fsync.
+ *    Nothing changed, nothing written.
+ * A failed checkpoint makes the next one full: the dirty marks are gone.
+ * It leaves the image invalid, it is never truncated on an error.
+ */
+static int asgn1_checkpoint(struct asgn1_dev *dev, bool throttle)
+{
+    unsigned long index = 0;
+    struct asgn1_ckpt *ck;
+    bool full, invalid;
+    size_t size;
+    int rc;
+
+    ck = asgn1_ckpt_alloc(true);
+    if (!ck)
+        return -ENOMEM;
+
+    full = READ_ONCE(dev->ckpt_full);
+    WRITE_ONCE(dev->ckpt_full, false);
+    invalid = full || !xa_empty(&dev->ckpt_holes);
+    rc = invalid ? asgn1_ckpt_invalidate(dev) : 0;
+    if (!rc && full) {
+        xa_destroy(&dev->ckpt_holes);
+        rc = vfs_truncate(&dev->ckpt_file->f_path, PAGE_SIZE);
+    } else if (!rc) {
+        rc = asgn1_ckpt_holes(dev);
+    }
+
+    while (!rc && asgn1_ckpt_next(dev, &index, full)) {
+        // First dirty page of an incremental checkpoint
+        if (!invalid) {
+            rc = asgn1_ckpt_invalidate(dev);
+            if (rc)
+                break;
+            invalid = true;
+        }
+        if (throttle)
+            asgn1_ckpt_throttle(dev);
+        rc = asgn1_ckpt_batch(dev, ck, index, full);
+        if (rc > 0)
+            rc = 0;
+        index += ASGN1_CKPT_BATCH;
+        if (index < ASGN1_CKPT_BATCH)
+            break;
+        cond_resched();
+    }
+
+    size = asgn1_size(dev);
+    if (!rc && (invalid || size != dev->ckpt_size)) {
+        rc = asgn1_ckpt_write_hdr(dev, size);
+        if (!rc)
+            rc = vfs_fsync(dev->ckpt_file, 0);
+        if (!rc) {
+            dev->ckpt_size = size;
+            atomic_long_inc(&dev->checkpoints);
+        }
+    }
+    if (rc) {
+        WRITE_ONCE(dev->ckpt_full, true);
+        pr_warn_ratelimited(DRV_NAME ": %s: checkpoint failed: %d\n", dev->ckpt_path, rc);
+    }
+
+    asgn1_ckpt_free(ck);
+    return rc;
+}
+
+// ckpt_work, every ckpt_interval_ms
+static void asgn1_ckpt_fn(struct work_struct *work)
+{
+    struct asgn1_dev *dev = container_of(to_delayed_work(work), struct asgn1_dev,
+                                         ckpt_work);
+    unsigned int interval = READ_ONCE(dev->ckpt_interval_ms);
+
+    if (!interval)
+        return;
+
+    asgn1_checkpoint(dev, true);
+    queue_delayed_work(system_unbound_wq, &dev->ckpt_work, msecs_to_jiffies(interval));
+}
+
+/*
+ * Read image bytes [start, end) into fresh store pages, ASGN1_CKPT_BATCH
+ * pages per vfs_iter_read(), straight into the pages that get stored.
+ * A short read is the end of the file, the rest reads as zeros.
+ */
+static int asgn1_ckpt_read_run(struct asgn1_dev *dev, struct asgn1_ckpt *ck,
+                               loff_t start, loff_t end)
+{
+    while (start < end) {
+        unsigned int nr = min_t(loff_t, ASGN1_CKPT_BATCH, (end - start) >> PAGE_SHIFT);
+        pgoff_t index = (start >> PAGE_SHIFT) - 1;
+        struct iov_iter iter;
+        loff_t pos = start;
+        unsigned int i;
+        ssize_t n;
+        int rc = 0;
+
+        for (i = 0; i < nr; i++) {
+            ck->stage[i] = alloc_page(GFP_KERNEL);
+            if (!ck->stage[i]) {
+                rc = -ENOMEM;
+                break;
+            }
+            ck->bv[i].bv_page = ck->stage[i];
+            ck->bv[i].bv_len = PAGE_SIZE;
+            ck->bv[i].bv_offset = 0;
+        }
+
+        if (!rc) {
+            iov_iter_bvec(&iter, ITER_DEST, ck->bv, nr, (size_t)nr << PAGE_SHIFT);
+            n = vfs_iter_read(dev->ckpt_file, &iter, &pos, 0);
+            if (n < 0)
+                rc = n;
+            else
+                iov_iter_zero(iov_iter_count(&iter), &iter);
+        }
+
+        for (i = 0; i < nr && !rc; i++) {
+            rc = xa_insert(dev->pages, index + i, ck->stage[i], GFP_KERNEL);
+            if (!rc)
+                ck->stage[i] = NULL;
+        }
+        for (i = 0; i < nr; i++) {
+            if (ck->stage[i])
+                __free_page(ck->stage[i]);
+            ck->stage[i] = NULL;
+        }
+        if (rc)
+            return rc;
+
+        dev->nr_pages += nr;
+        dev->end_index = max_t(pgoff_t, dev->end_index, index + nr);
+        atomic_long_add(nr, &dev->restored_pages);
+        asgn1_stat_add(dev, ASGN1_STAT_PAGES_ALLOCATED, nr);
+        start += (loff_t)nr << PAGE_SHIFT;
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * Reload the store from the image at create, before anyone can reach it.
+ * 1. Only an image with our header and page size is trusted, anything
+ *    else is replaced by the first (full) checkpoint.
+ * 2. SEEK_DATA/SEEK_HOLE skip the image's holes, each data run is read
+ *    in bulk, see asgn1_ckpt_read_run().
+ * 3. Restored pages are clean, the image already has them.
+ */
+static int asgn1_ckpt_restore(struct asgn1_dev *dev)
+{
+    struct asgn1_ckpt_hdr hdr;
+    struct asgn1_ckpt *ck;
+    loff_t pos = 0, data, hole, limit;
+    size_t size;
+    ssize_t n;
+    int rc = 0;
+
+    n = kernel_read(dev->ckpt_file, &hdr, sizeof(hdr), &pos);
+    if (n != sizeof(hdr) || memcmp(hdr.magic, ASGN1_CKPT_MAGIC, sizeof(hdr.magic)) ||
+        le32_to_cpu(hdr.version) != ASGN1_CKPT_VERSION ||
+        le32_to_cpu(hdr.page_size) != PAGE_SIZE) {
+        if (n == sizeof(hdr) && !memchr_inv(hdr.magic, 0, sizeof(hdr.magic)))
+            pr_warn(DRV_NAME ": %s: no complete checkpoint, starting empty\n",
+                    dev->ckpt_path);
+        else if (n > 0)
+            pr_warn(DRV_NAME ": %s: not an image of this build, starting empty\n",
+                    dev->ckpt_path);
+        dev->ckpt_full = true;
+        return 0;
+    }
+
+    ck = asgn1_ckpt_alloc(false);
+    if (!ck)
+        return -ENOMEM;
+
+    size = le64_to_cpu(hdr.size_bytes);
+    limit = asgn1_ckpt_pos(DIV_ROUND_UP(size, PAGE_SIZE));
+    for (pos = PAGE_SIZE; pos < limit; pos = hole) {
+        data = vfs_llseek(dev->ckpt_file, pos, SEEK_DATA);
+        if (data < 0 || data >= limit)
+            break;      // -ENXIO: no data after pos
+        hole = vfs_llseek(dev->ckpt_file, data, SEEK_HOLE);
+        if (hole < 0) {
+            rc = hole;
+            break;
+        }
+        hole = min(round_up(hole, PAGE_SIZE), limit);
+        rc = asgn1_ckpt_read_run(dev, ck, round_down(data, PAGE_SIZE), hole);
+        if (rc)
+            break;
+    }
+    kfree(ck);
+
+    if (rc)
+        return rc;
+    atomic_long_set(&dev->size_bytes, size);
+    dev->ckpt_size = size;
+    return 0;
+}
+
+/*
+ * Open (or create) this instance's image under backing_dir.
+ * 1. Nothing to do without backing_dir.
+ * 2. restore: reload the store from it, see asgn1_ckpt_restore().
+ *    Otherwise (a snapshot) the first checkpoint rewrites it.
+ * ckpt_work is only started once the instance is live.
+ */
+static int asgn1_ckpt_open(struct asgn1_dev *dev, bool restore)
+{
+    struct file *file;
+    char *path;
+    int rc;
+
+    if (!backing_dir || !*backing_dir)
+        return 0;
+
+    path = kasprintf(GFP_KERNEL, "%s/%s%d.img", backing_dir, asgn1_name, dev->minor);
+    if (!path)
+        return -ENOMEM;
+    file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        pr_err(DRV_NAME ": opening %s failed: %ld\n", path, PTR_ERR(file));
+        kfree(path);
+        return PTR_ERR(file);
+    }
+    dev->ckpt_file = file;
+    dev->ckpt_path = path;
+    dev->ckpt_interval_ms = ASGN1_CKPT_INTERVAL_DEF;
+    dev->ckpt_budget_us = ASGN1_CKPT_BUDGET_DEF;
+    dev->ckpt_full = true;
+
+    if (!restore)
+        return 0;
+    rc = asgn1_ckpt_restore(dev);
+    if (rc) {
+        pr_err(DRV_NAME ": restoring %s failed: %d\n", path, rc);
+        return rc;
+    }
+    if (atomic_long_read(&dev->restored_pages))
+        pr_info(DRV_NAME ": restored %ld pages from %s\n",
+                atomic_long_read(&dev->restored_pages), path);
+    return 0;
+}
+
+/*
+ * Last checkpoint and close, after ckpt_work is stopped.
+ * 1. final: checkpoint everything left unthrottled, or with ckpt_discard
+ *    (destroyed on request) invalidate the header, so no later instance of
+ *    this minor restores it. The data stays until that instance's first
+ *    (full) checkpoint reuses the file.
+ * 2. Without final (create failed) the image is left as it was.
+ */
+static void asgn1_ckpt_close(struct asgn1_dev *dev, bool final)
+{
+    if (!dev->ckpt_file)
+        return;
+
+    if (final && dev->ckpt_discard)
+        asgn1_ckpt_invalidate(dev);
+    else if (final)
+        asgn1_checkpoint(dev, false);
+
+    fput(dev->ckpt_file);
+    dev->ckpt_file = NULL;
+    kfree(dev->ckpt_path);
+    dev->ckpt_path = NULL;
+    xa_destroy(&dev->ckpt_holes);
+}
+
+/* ---------- sysfs attributes, /sys/class/asgn1/<node>/ ---------- */
+
+static ssize_t huge_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(dev->huge));
+}
+
+/*
+* 1. Opt in/out of huge extents
+* 2. Only affects pages allocated from now on, truncate to convert an image
+*/
+static ssize_t huge_store(struct device *d, struct device_attribute *attr,
+                          const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    bool val;
+    int rc;
+
+    rc = kstrtobool(buf, &val);
+    if (rc)
+        return rc;
+    WRITE_ONCE(dev->huge, val);
+    return len;
+}
+static DEVICE_ATTR_RW(huge);
+
+// Resident pages, holes in a sparse image don't count
+static ssize_t nr_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(dev->nr_pages));
+}
+static DEVICE_ATTR_RO(nr_pages);
+
+static ssize_t fault_around_show(struct device *d, struct device_attribute *attr,
+                                 char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->fault_around));
+}
+
+/*
+* 1. Pages mapped per user fault, 1 disables fault-around
+* 2. Power of two so windows are aligned and never overlap
+*/
+static ssize_t fault_around_store(struct device *d, struct device_attribute *attr,
+                                  const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned int val;
+    int rc;
+
+    rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+    if (!val || val > ASGN1_HPAGE_NR || !is_power_of_2(val))
+        return -EINVAL;
+    WRITE_ONCE(dev->fault_around, val);
+    return len;
+}
+static DEVICE_ATTR_RW(fault_around);
+
+static ssize_t numa_policy_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%s\n", asgn1_numa_names[READ_ONCE(dev->numa_policy)]);
+}
+
+/*
+* 1. local, interleave or bind (to numa_node)
+* 2. Only affects pages allocated from now on, truncate to re-place an image
+* 3. Leaving local empties the recycle pool, its pages are on any node
+*/
+static ssize_t numa_policy_store(struct device *d, struct device_attribute *attr,
+                                 const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    int val = sysfs_match_string(asgn1_numa_names, buf);
+
+    if (val < 0)
+        return val;
+    WRITE_ONCE(dev->numa_policy, val);
+    if (val != ASGN1_NUMA_LOCAL)
+        asgn1_pool_drain(dev);
+    return len;
+}
+static DEVICE_ATTR_RW(numa_policy);
+
+static ssize_t numa_node_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(dev->numa_node));
+}
+
+// The node bind places pages on, it must have memory
+static ssize_t numa_node_store(struct device *d, struct device_attribute *attr,
+                               const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    int val, rc;
+
+    rc = kstrtoint(buf, 0, &val);
+    if (rc)
+        return rc;
+    if (val < 0 || val >= nr_node_ids || !node_state(val, N_MEMORY))
+        return -EINVAL;
+    WRITE_ONCE(dev->numa_node, val);
+    return len;
+}
+static DEVICE_ATTR_RW(numa_node);
+
+/*
+* 1. Resident pages per node, as N<node>=<pages> like numa_maps
+* 2. Walks the store ASGN1_WALK_CHUNK indices at a time, held shared,
+*    so it only briefly holds off writers
+* 3. Shared pages count once per entry, compressed pages not at all
+*/
+static ssize_t node_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned long *counts, start, index;
+    int nid, len = 0;
+    void *entry;
+
+    counts = kcalloc(nr_node_ids, sizeof(*counts), GFP_KERNEL);
+    if (!counts)
+        return -ENOMEM;
+
+    for (start = 0; start < READ_ONCE(dev->end_index); start += ASGN1_WALK_CHUNK) {
+        unsigned long last = start + ASGN1_WALK_CHUNK - 1;
+        struct asgn1_range r;
+
+        asgn1_range_lock(dev, &r, start, last, false);
+        xa_for_each_range(dev->pages, index, entry, start, last) {
+            if (asgn1_entry_is_zpage(entry))
+                continue;
+            if (asgn1_entry_is_shared(entry))
+                entry = asgn1_entry_shared(entry)->page;
+            counts[page_to_nid(entry)]++;
+        }
+        asgn1_range_unlock(dev, &r);
+        cond_resched();
+    }
+
+    for_each_node_state(nid, N_MEMORY)
+        len += sysfs_emit_at(buf, len, "%sN%d=%lu", len ? " " : "", nid, counts[nid]);
+    len += sysfs_emit_at(buf, len, "\n");
+    kfree(counts);
+    return len;
+}
+static DEVICE_ATTR_RO(node_pages);
+
+static ssize_t follow_waits_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->follow_waits));
+}
+static DEVICE_ATTR_RO(follow_waits);
+
+#define ASGN1_COUNTER_ATTR(name)                                              \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr,  \
+                           char *buf)                                         \
+{                                                                             \
+    struct asgn1_dev *dev = dev_get_drvdata(d);                               \
+                                                                              \
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->name));            \
+}                                                                             \
+static DEVICE_ATTR_RO(name)
+
+ASGN1_COUNTER_ATTR(nr_huge);
+ASGN1_COUNTER_ATTR(huge_alloc_fails);
+ASGN1_COUNTER_ATTR(nr_dirty);
+ASGN1_COUNTER_ATTR(mmap_grown);
+ASGN1_COUNTER_ATTR(hole_maps);
+ASGN1_COUNTER_ATTR(reclaim_backlog);
+ASGN1_COUNTER_ATTR(pool_hits);
+ASGN1_COUNTER_ATTR(pool_misses);
+ASGN1_COUNTER_ATTR(nr_compressed);
+ASGN1_COUNTER_ATTR(compressed_bytes);
+ASGN1_COUNTER_ATTR(decompressions);
+ASGN1_COUNTER_ATTR(decompress_ns);
+ASGN1_COUNTER_ATTR(nr_shared);
+ASGN1_COUNTER_ATTR(zero_pages);
+ASGN1_COUNTER_ATTR(cow_breaks);
+ASGN1_COUNTER_ATTR(dedup_scans);
+ASGN1_COUNTER_ATTR(checkpoints);
+ASGN1_COUNTER_ATTR(ckpt_pages);
+ASGN1_COUNTER_ATTR(ckpt_throttled);
+ASGN1_COUNTER_ATTR(restored_pages);
+ASGN1_COUNTER_ATTR(fg_lat_ns);
+
+#define ASGN1_STAT_ATTR(name, i)                                              \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr,  \
+                           char *buf)                                         \
+{                                                                             \
+    return sysfs_emit(buf, "%llu\n", asgn1_stat_sum(dev_get_drvdata(d), i));  \
+}                                                                             \
+static DEVICE_ATTR_RO(name)
+
+ASGN1_STAT_ATTR(pte_faults, ASGN1_STAT_PTE_FAULTS);
+ASGN1_STAT_ATTR(pmd_faults, ASGN1_STAT_PMD_FAULTS);
+ASGN1_STAT_ATTR(prefaulted, ASGN1_STAT_PREFAULTED);
+ASGN1_STAT_ATTR(pages_allocated, ASGN1_STAT_PAGES_ALLOCATED);
+ASGN1_STAT_ATTR(pages_freed, ASGN1_STAT_PAGES_FREED);
+ASGN1_STAT_ATTR(range_locks, ASGN1_STAT_RANGE_LOCKS);
+ASGN1_STAT_ATTR(range_walked, ASGN1_STAT_RANGE_WALKED);
+ASGN1_STAT_ATTR(range_waits, ASGN1_STAT_RANGE_WAITS);
+ASGN1_STAT_ATTR(range_wait_ns, ASGN1_STAT_RANGE_WAIT_NS);
+ASGN1_STAT_ATTR(grow_waits, ASGN1_STAT_GROW_WAITS);
+ASGN1_STAT_ATTR(grow_wait_ns, ASGN1_STAT_GROW_WAIT_NS);
+
+// read() plus block device reads, or write() plus block device writes
+static u64 asgn1_io_sum(struct asgn1_dev *dev, bool write, bool bytes)
+{
+    enum asgn1_op a = write ? ASGN1_OP_WRITE : ASGN1_OP_READ;
+    enum asgn1_op b = write ? ASGN1_OP_BLK_WRITE : ASGN1_OP_BLK_READ;
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct asgn1_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+        sum += bytes ? st->bytes[a] + st->bytes[b] : st->ops[a] + st->ops[b];
+    }
+    return sum;
+}
+
+#define ASGN1_IO_ATTR(name, write, bytes)                                     \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr,  \
+                           char *buf)                                         \
+{                                                                             \
+    return sysfs_emit(buf, "%llu\n",                                          \
+                      asgn1_io_sum(dev_get_drvdata(d), write, bytes));        \
+}                                                                             \
+static DEVICE_ATTR_RO(name)
+
+ASGN1_IO_ATTR(read_ops, false, false);
+ASGN1_IO_ATTR(read_bytes, false, true);
+ASGN1_IO_ATTR(write_ops, true, false);
+ASGN1_IO_ATTR(write_bytes, true, true);
+
+// Bytes of image data this instance holds alone: private pages plus compressed copies
+static ssize_t resident_bytes_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    long nr = READ_ONCE(dev->nr_pages) - atomic_long_read(&dev->nr_compressed) -
+              atomic_long_read(&dev->nr_shared);
+
+    return sysfs_emit(buf, "%ld\n", max(nr, 0L) * (long)PAGE_SIZE +
+                      atomic_long_read(&dev->compressed_bytes));
+}
+static DEVICE_ATTR_RO(resident_bytes);
+
+static ssize_t compress_interval_ms_show(struct device *d, struct device_attribute *attr,
+                                         char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->compress_interval_ms));
+}
+
+/*
+* 1. Pages idle for a whole interval get compressed, 0 turns it off
+* 2. Turning it off leaves compressed pages alone, they come back on access
+* 3. Serialized by dev->lock
+*/
+static ssize_t compress_interval_ms_store(struct device *d, struct device_attribute *attr,
+                                          const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned int val;
+    int rc;
+
+    rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    mutex_lock(&dev->lock);
+    if (!READ_ONCE(dev->compress_interval_ms) || !val) {
+        WRITE_ONCE(dev->compress_interval_ms, 0);
+        cancel_delayed_work_sync(&dev->compress_work);
+        dev->compress_primed = false;
+    }
+    WRITE_ONCE(dev->compress_interval_ms, val);
+    if (val)
+        mod_delayed_work(system_unbound_wq, &dev->compress_work, msecs_to_jiffies(val));
+    mutex_unlock(&dev->lock);
+    return len;
+}
+static DEVICE_ATTR_RW(compress_interval_ms);
+
+static ssize_t dedup_interval_ms_show(struct device *d, struct device_attribute *attr,
+                                      char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->dedup_interval_ms));
+}
+
+/*
+* 1. Run the dedup scan every interval, 0 turns it off
+* 2. Turning it off keeps pages shared, they unshare when written
+* 3. Serialized by dev->lock
+*/
+static ssize_t dedup_interval_ms_store(struct device *d, struct device_attribute *attr,
+                                       const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned int val;
+    int rc;
+
+    rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    mutex_lock(&dev->lock);
+    if (!READ_ONCE(dev->dedup_interval_ms) || !val) {
+        WRITE_ONCE(dev->dedup_interval_ms, 0);
+        cancel_delayed_work_sync(&dev->dedup_work);
+        asgn1_dedup_reset(dev);
+    }
+    WRITE_ONCE(dev->dedup_interval_ms, val);
+    if (val)
+        mod_delayed_work(system_unbound_wq, &dev->dedup_work, msecs_to_jiffies(val));
+    mutex_unlock(&dev->lock);
+    return len;
+}
+static DEVICE_ATTR_RW(dedup_interval_ms);
+
+static ssize_t dedup_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->dedup_pages));
+}
+
+// Pages the dedup scan looks at per interval, the scan rate limit
+static ssize_t dedup_pages_store(struct device *d, struct device_attribute *attr,
+                                 const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned int val;
+    int rc;
+
+    rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+    if (!val)
+        return -EINVAL;
+
+    WRITE_ONCE(dev->dedup_pages, val);
+    return len;
+}
+static DEVICE_ATTR_RW(dedup_pages);
+
+static ssize_t backing_file_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%s\n", dev->ckpt_path ? dev->ckpt_path : "");
+}
+static DEVICE_ATTR_RO(backing_file);
+
+static ssize_t checkpoint_interval_ms_show(struct device *d, struct device_attribute *attr,
+                                           char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->ckpt_interval_ms));
+}
+
+/*
+* 1. Checkpoint every interval, 0 leaves only the one at unload
+* 2. -ENODEV without a backing file
+* 3. Serialized by dev->lock
+*/
+static ssize_t checkpoint_interval_ms_store(struct device *d, struct device_attribute *attr,
+                                            const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned int val;
+    int rc;
+
+    rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+    if (!dev->ckpt_file)
+        return -ENODEV;
+
+    mutex_lock(&dev->lock);
+    WRITE_ONCE(dev->ckpt_interval_ms, val);
+    if (val)
+        mod_delayed_work(system_unbound_wq, &dev->ckpt_work, msecs_to_jiffies(val));
+    else
+        cancel_delayed_work_sync(&dev->ckpt_work);
+    mutex_unlock(&dev->lock);
+    return len;
+}
+static DEVICE_ATTR_RW(checkpoint_interval_ms);
+
+static ssize_t checkpoint_budget_us_show(struct device *d, struct device_attribute *attr,
+                                         char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->ckpt_budget_us));
+}
+
+// Foreground read/write latency checkpoints yield to, 0 never yields
+static ssize_t checkpoint_budget_us_store(struct device *d, struct device_attribute *attr,
+                                          const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    unsigned int val;
+    int rc;
+
+    rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    WRITE_ONCE(dev->ckpt_budget_us, val);
+    return len;
+}
+static DEVICE_ATTR_RW(checkpoint_budget_us);
+
+static ssize_t pool_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->pool_nr));
+}
+static DEVICE_ATTR_RO(pool_pages);
+
+static ssize_t pool_max_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->pool_max));
+}
+
+/*
+* 1. Bound of the recycle pool in pages, 0 disables it
+* 2. Shrinking the bound trims the pool right away
+*/
+static ssize_t pool_max_store(struct device *d, struct device_attribute *attr,
+                              const char *buf, size_t len)
+{
+    struct asgn1_dev *dev = dev_get_drvdata(d);
+    struct page *page, *tmp;
+    unsigned long val;
+    LIST_HEAD(list);
+    int rc;
+
+    rc = kstrtoul(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    spin_lock(&dev->pool_lock);
+    WRITE_ONCE(dev->pool_max, val);
+    spin_unlock(&dev->pool_lock);
+    if (READ_ONCE(dev->pool_nr) > val)
+        asgn1_pool_take(dev, &list, READ_ONCE(dev->pool_nr) - val);
+    list_for_each_entry_safe(page, tmp, &list, lru) {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+    return len;
+}
+static DEVICE_ATTR_RW(pool_max);
+
+static struct attribute *asgn1_dev_attrs[] = {
+    &dev_attr_huge.attr,
+    &dev_attr_nr_pages.attr,
+    &dev_attr_nr_huge.attr,
+    &dev_attr_huge_alloc_fails.attr,
+    &dev_attr_pte_faults.attr,
+    &dev_attr_pmd_faults.attr,
+    &dev_attr_fault_around.attr,
+    &dev_attr_numa_policy.attr,
+    &dev_attr_numa_node.attr,
+    &dev_attr_node_pages.attr,
+    &dev_attr_follow_waits.attr,
+    &dev_attr_prefaulted.attr,
+    &dev_attr_nr_dirty.attr,
+    &dev_attr_mmap_grown.attr,
+    &dev_attr_hole_maps.attr,
+    &dev_attr_reclaim_backlog.attr,
+    &dev_attr_pool_pages.attr,
+    &dev_attr_pool_max.attr,
+    &dev_attr_pool_hits.attr,
+    &dev_attr_pool_misses.attr,
+    &dev_attr_compress_interval_ms.attr,
+    &dev_attr_nr_compressed.attr,
+    &dev_attr_compressed_bytes.attr,
+    &dev_attr_resident_bytes.attr,
+    &dev_attr_decompressions.attr,
+    &dev_attr_decompress_ns.attr,
+    &dev_attr_dedup_interval_ms.attr,
+    &dev_attr_dedup_pages.attr,
+    &dev_attr_nr_shared.attr,
+    &dev_attr_zero_pages.attr,
+    &dev_attr_cow_breaks.attr,
+    &dev_attr_dedup_scans.attr,
+    &dev_attr_backing_file.attr,
+    &dev_attr_checkpoint_interval_ms.attr,
+    &dev_attr_checkpoint_budget_us.attr,
+    &dev_attr_checkpoints.attr,
+    &dev_attr_ckpt_pages.attr,
+    &dev_attr_ckpt_throttled.attr,
+    &dev_attr_restored_pages.attr,
+    &dev_attr_fg_lat_ns.attr,
+    &dev_attr_read_ops.attr,
+    &dev_attr_read_bytes.attr,
+    &dev_attr_write_ops.attr,
+    &dev_attr_write_bytes.attr,
+    &dev_attr_pages_allocated.attr,
+    &dev_attr_pages_freed.attr,
+    &dev_attr_range_locks.attr,
+    &dev_attr_range_walked.attr,
+    &dev_attr_range_waits.attr,
+    &dev_attr_range_wait_ns.attr,
+    &dev_attr_grow_waits.attr,
+    &dev_attr_grow_wait_ns.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(asgn1_dev);
+
+/* ---------- debugfs, /sys/kernel/debug/asgn1/<node>/ ---------- */
+
+static const char * const asgn1_op_names[ASGN1_NR_OPS] = {
+    [ASGN1_OP_READ]      = "read",
+    [ASGN1_OP_WRITE]     = "write",
+    [ASGN1_OP_FAULT]     = "fault",
+    [ASGN1_OP_BLK_READ]  = "blk_read",
+    [ASGN1_OP_BLK_WRITE] = "blk_write",
+};
+
+struct asgn1_op_totals {
+    u64 ops, bytes, lat_ns;
+    u64 hist[ASGN1_HIST_BUCKETS];
+};
+
+static void asgn1_op_sum(struct asgn1_dev *dev, enum asgn1_op op, struct asgn1_op_totals *t)
+{
+    int cpu, b;
+
+    memset(t, 0, sizeof(*t));
+    for_each_possible_cpu(cpu) {
+        struct asgn1_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+        t->ops += st->ops[op];
+        t->bytes += st->bytes[op];
+        t->lat_ns += st->lat_ns[op];
+        for (b = 0; b < ASGN1_HIST_BUCKETS; b++)
+            t->hist[b] += st->hist[op][b];
+    }
+}
+
+// Upper bound in ns of the bucket holding the permille'th latency
+static u64 asgn1_hist_pct(const struct asgn1_op_totals *t, unsigned int permille)
+{
+    u64 want = div_u64(t->ops * permille + 999, 1000), seen = 0;
+    int b;
+
+    for (b = 0; b < ASGN1_HIST_BUCKETS - 1; b++) {
+        seen += t->hist[b];
+        if (seen >= want)
+            break;
+    }
+    return t->ops ? 1ULL << b : 0;
+}
+
+/*
+ * latency: per operation count, bytes, mean and percentiles, then the
+ * non-empty histogram buckets as <upper bound ns>:<count>. Percentiles are
+ * bucket upper bounds, so within a factor of two.
+ */
+static int asgn1_latency_show(struct seq_file *m, void *v)
+{
+    struct asgn1_dev *dev = m->private;
+    struct asgn1_op_totals t;
+    int op, b;
+
+    seq_printf(m, "%-10s %12s %16s %10s %10s %10s %10s\n", "op", "count", "bytes",
+               "mean_ns", "p50_ns", "p99_ns", "p999_ns");
+    for (op = 0; op < ASGN1_NR_OPS; op++) {
+        asgn1_op_sum(dev, op, &t);
+        seq_printf(m, "%-10s %12llu %16llu %10llu %10llu %10llu %10llu\n",
+                   asgn1_op_names[op], t.ops, t.bytes,
+                   t.ops ? div64_u64(t.lat_ns, t.ops) : 0,
+                   asgn1_hist_pct(&t, 500), asgn1_hist_pct(&t, 990),
+                   asgn1_hist_pct(&t, 999));
+    }
+
+    seq_putc(m, '\n');
+    for (op = 0; op < ASGN1_NR_OPS; op++) {
+        asgn1_op_sum(dev, op, &t);
+        seq_printf(m, "%s:", asgn1_op_names[op]);
+        for (b = 0; b < ASGN1_HIST_BUCKETS; b++)
+            if (t.hist[b])
+                seq_printf(m, " %llu:%llu", 1ULL << b, t.hist[b]);
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(asgn1_latency);
+
+/* ---------- instance manage fns ---------- */
+
+static const struct file_operations asgn1_fops;
+static int asgn1_blk_add(struct asgn1_dev *dev);
+static void asgn1_blk_del(struct asgn1_dev *dev);
+
+/*
+* 1. A bare instance: empty store, locks and defaults, no node, no table
+*    entry, no checkpoint file, no background work queued
+* 2. asgn1_dev_create() registers it, the KUnit suite drives it as is
+*/
+static struct asgn1_dev *asgn1_dev_alloc(void)
+{
+    struct asgn1_dev *dev;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return NULL;
+    dev->pages = kmalloc(sizeof(*dev->pages), GFP_KERNEL);
+    dev->stats = alloc_percpu(struct asgn1_stats);
+    if (!dev->pages || !dev->stats) {
+        free_percpu(dev->stats);
+        kfree(dev->pages);
+        kfree(dev);
+        return NULL;
+    }
+
+    xa_init(dev->pages);
+    mutex_init(&dev->grow_lock);
+    atomic_long_set(&dev->size_bytes, 0);
+    spin_lock_init(&dev->range_lock);
+    INIT_LIST_HEAD(&dev->ranges);
+    init_waitqueue_head(&dev->range_wq);
+    mutex_init(&dev->lock);
+    dev->max_users = 0;   // 0 == unlimited
+    atomic_set(&dev->open_count, 0);
+    INIT_LIST_HEAD(&dev->open_waiters);
+    init_waitqueue_head(&dev->open_wq);
+    init_waitqueue_head(&dev->data_wq);
+    kref_init(&dev->ref);
+    dev->fault_around = ASGN1_FAULT_AROUND_DEF;
+    dev->numa_policy = ASGN1_NUMA_LOCAL;
+    dev->numa_node = first_memory_node;
+    dev->numa_next = NUMA_NO_NODE;
+    spin_lock_init(&dev->pool_lock);
+    INIT_LIST_HEAD(&dev->pool);
+    dev->pool_max = ASGN1_POOL_MAX_DEF;
+    INIT_DELAYED_WORK(&dev->compress_work, asgn1_compress_fn);
+    dev->dedup_pages = ASGN1_DEDUP_PAGES_DEF;
+    INIT_DELAYED_WORK(&dev->dedup_work, asgn1_dedup_fn);
+    xa_init(&dev->ckpt_holes);
+    INIT_DELAYED_WORK(&dev->ckpt_work, asgn1_ckpt_fn);
+    return dev;
+}
+
+// Free what asgn1_dev_alloc() set up, and every page stored since
+static void asgn1_dev_free(struct asgn1_dev *dev)
+{
+    asgn1_free_all_pages_locked(dev);
+    asgn1_pool_drain(dev);
+    free_percpu(dev->stats);
+    kfree(dev->pages);
+    kfree(dev);
+}
+
+/*
+* 1. kref release, runs once the table and every open file let go
+* 2. Takes the last checkpoint, see asgn1_ckpt_close()
+* 3. Frees the page store and the instance itself
+*/
+static void asgn1_dev_release(struct kref *ref)
+{
+    struct asgn1_dev *dev = container_of(ref, struct asgn1_dev, ref);
+
+    WRITE_ONCE(dev->ckpt_interval_ms, 0);
+    cancel_delayed_work_sync(&dev->ckpt_work);
+    WRITE_ONCE(dev->compress_interval_ms, 0);
+    cancel_delayed_work_sync(&dev->compress_work);
+    WRITE_ONCE(dev->dedup_interval_ms, 0);
+    cancel_delayed_work_sync(&dev->dedup_work);
+    asgn1_dedup_reset(dev);
+    asgn1_ckpt_close(dev, true);
+    asgn1_shrinker_unregister(dev);
+    asgn1_dev_free(dev);
+}
+
+/*
+ * Share the huge extent headed at index between src and the snapshot dev.
+ * 1. Every subpage gets its own asgn1_shared and folio reference, the
+ *    store's single reference to the extent is dropped.
+ * 2. All or nothing: dev's entries are inserted first, src's replaced
+ *    entries can't fail.
+ */
+static int asgn1_snapshot_huge_locked(struct asgn1_dev *dev, struct asgn1_dev *src,
+                                      pgoff_t index, struct page *head)
+{
+    struct folio *folio = page_folio(head);
+    unsigned long i, nr = folio_nr_pages(folio);
+    struct asgn1_shared *sh;
+    int rc = 0;
+
+    for (i = 0; i < nr; i++) {
+        sh = kmalloc(sizeof(*sh), GFP_KERNEL);
+        if (!sh) {
+            rc = -ENOMEM;
+            break;
+        }
+        sh->page = folio_page(folio, i);
+        atomic_set(&sh->users, 2);
+        rc = xa_insert(dev->pages, index + i, xa_tag_pointer(sh, ASGN1_TAG_SHARED), GFP_KERNEL);
+        if (rc) {
+            kfree(sh);
+            break;
+        }
+    }
+    if (rc) {
+        while (i--)
+            kfree(asgn1_entry_shared(xa_erase(dev->pages, index + i)));
+        return rc;
+    }
+
+    folio_ref_add(folio, nr);
+    for (i = 0; i < nr; i++)
+        xa_store(src->pages, index + i, xa_load(dev->pages, index + i), GFP_KERNEL);
+    folio->mapping = NULL;
+    folio_put(folio);
+    atomic_long_dec(&src->nr_huge);
+    atomic_long_add(nr, &src->nr_shared);
+    atomic_long_add(nr, &dev->nr_shared);
+    dev->nr_pages += nr;
+    return 0;
+}
+
+/*
+ * Fill dev's empty store with a point-in-time copy of src's, sharing
+ * pages instead of copying them (O(entries), no data copied).
+ * 1. src is held whole and exclusively, so no write or fault is in flight.
+ * 2. src's mappings are zapped, its next write faults unshare first.
+ * 3. Plain pages and huge subpages become shared with users 2, shared
+ *    ones gain a user. Compressed copies are small and just duplicated.
+ * dev is not visible yet, so it needs no locking of its own.
+ */
+static int asgn1_snapshot_fill(struct asgn1_dev *dev, struct asgn1_dev *src)
+{
+    pgoff_t skip = 0;
+    struct asgn1_range r;
+    unsigned long index;
+    void *entry;
+    int rc = 0;
+
+    asgn1_range_lock(src, &r, 0, ASGN1_RANGE_ALL, true);
+    if (src->mapping)
+        unmap_mapping_range(src->mapping, 0, 0, 0);
+    asgn1_grow_lock(src);
+
+    xa_for_each(src->pages, index, entry) {
+        struct asgn1_shared *sh;
+        void *snap;
+
+        if (index < skip)
+            continue;   // tail of a huge extent shared below
+
+        if (asgn1_entry_is_zpage(entry)) {
+            struct asgn1_zpage *zp = asgn1_entry_zpage(entry);
+
+            zp = kmemdup(zp, struct_size(zp, data, zp->len), GFP_KERNEL);
+            if (!zp) {
+                rc = -ENOMEM;
+                break;
+            }
+            atomic_long_inc(&dev->nr_compressed);
+            atomic_long_add(zp->len, &dev->compressed_bytes);
+            snap = xa_tag_pointer(zp, ASGN1_TAG_ZPAGE);
+        } else if (asgn1_entry_is_shared(entry)) {
+            sh = asgn1_entry_shared(entry);
+            atomic_inc(&sh->users);
+            atomic_long_inc(&dev->nr_shared);
+            snap = entry;
+        } else if (PageCompound((struct page *)entry)) {
+            rc = asgn1_snapshot_huge_locked(dev, src, index, entry);
+            if (rc)
+                break;
+            skip = index + folio_nr_pages(page_folio(entry));
+            continue;
+        } else {
+            sh = kmalloc(sizeof(*sh), GFP_KERNEL);
+            if (!sh) {
+                rc = -ENOMEM;
+                break;
+            }
+            sh->page = entry;
+            atomic_set(&sh->users, 2);
+            page_folio(sh->page)->mapping = NULL;
+            xa_store(src->pages, index, xa_tag_pointer(sh, ASGN1_TAG_SHARED), GFP_KERNEL);
+            atomic_long_inc(&src->nr_shared);
+            atomic_long_inc(&dev->nr_shared);
+            snap = xa_tag_pointer(sh, ASGN1_TAG_SHARED);
+        }
+
+        rc = xa_insert(dev->pages, index, snap, GFP_KERNEL);
+        if (rc) {
+            if (asgn1_entry_is_zpage(snap))
+                kfree(asgn1_entry_zpage(snap));
+            else
+                asgn1_shared_put(dev, asgn1_entry_shared(snap));
+            break;
+        }
+        dev->nr_pages++;
+    }
+
+    dev->end_index = src->end_index;
+    atomic_long_set(&dev->size_bytes, asgn1_size(src));
+    mutex_unlock(&src->grow_lock);
+    asgn1_range_unlock(src, &r);
+    return rc;
+}
+
+/*
+ * Create a ramdisk instance.
+ * 1. Pick the wanted minor, or the first free one if minor < 0.
+ * 2. Allocate and initialize its private page store and locks.
+ * 3. With src, start the store as a snapshot of src's. Otherwise, with
+ *    backing_dir, restore it from the minor's checkpoint image.
+ * 4. Add its cdev and let udev create /dev/asgn1<minor>.
+ * Returns the minor on success, negative errno on failure.
+ */
+static int asgn1_dev_create(int minor, struct asgn1_dev *src)
+{
+    struct asgn1_dev *dev;
+    dev_t devt;
+    int rc;
+
+    dev = asgn1_dev_alloc();
+    if (!dev)
+        return -ENOMEM;
+
+    if (src) {
+        rc = asgn1_snapshot_fill(dev, src);
+        if (rc)
+            goto err_free;
+    }
+
+    mutex_lock(&asgn1_devs_lock);
+
+    if (minor < 0) {
+        for (minor = 0; minor < ASGN1_MAX_DEVS; minor++)
+            if (!asgn1_devs[minor])
+                break;
+    }
+    if (minor >= ASGN1_MAX_DEVS) {
+        rc = -ENOSPC;
+        goto err_unlock;
+    }
+    if (asgn1_devs[minor]) {
+        rc = -EEXIST;
+        goto err_unlock;
+    }
+    dev->minor = minor;
+    devt = MKDEV(asgn1_major, minor);
+
+    rc = asgn1_shrinker_register(dev);
+    if (rc)
+        goto err_unlock;
+
+    rc = asgn1_ckpt_open(dev, !src);
+    if (rc)
+        goto err_ckpt;
+
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev) {
+        rc = -ENOMEM;
+        goto err_ckpt;
+    }
+    dev->cdev->owner = THIS_MODULE;
+    dev->cdev->ops = &asgn1_fops;
+    rc = cdev_add(dev->cdev, devt, 1);
+    if (rc) {
+        kobject_put(&dev->cdev->kobj);
+        goto err_ckpt;
+    }
+
+    // Minor 0 keeps the original /dev/asgn1 name
+    if (minor)
+        dev->device = device_create_with_groups(asgn1_class, NULL, devt, dev,
+                                                asgn1_dev_groups, "%s%d",
+                                                asgn1_name, minor);
+    else
+        dev->device = device_create_with_groups(asgn1_class, NULL, devt, dev,
+                                                asgn1_dev_groups, "%s",
+                                                asgn1_name);
+    if (IS_ERR(dev->device)) {
+        rc = PTR_ERR(dev->device);
+        goto err_cdev;
+    }
+
+    rc = asgn1_blk_add(dev);
+    if (rc)
+        goto err_device;
+
+    // Best effort, like all of debugfs
+    dev->debugfs = debugfs_create_dir(dev_name(dev->device), asgn1_debugfs);
+    debugfs_create_file("latency", 0444, dev->debugfs, dev, &asgn1_latency_fops);
+
+    asgn1_devs[minor] = dev;
+    mutex_unlock(&asgn1_devs_lock);
+
+    if (dev->ckpt_file)
+        queue_delayed_work(system_unbound_wq, &dev->ckpt_work,
+                           msecs_to_jiffies(dev->ckpt_interval_ms));
+
+    pr_info(DRV_NAME ": created instance %d:%d\n", asgn1_major, minor);
+    return minor;
+
+err_device:
+    device_destroy(asgn1_class, devt);
+err_cdev:
+    cdev_del(dev->cdev);
+err_ckpt:
+    asgn1_ckpt_close(dev, false);
+    asgn1_shrinker_unregister(dev);
+err_unlock:
+    mutex_unlock(&asgn1_devs_lock);
+err_free:
+    asgn1_dev_free(dev);
+    return rc;
+}
+
+/*
+ * Destroy a ramdisk instance.
+ * 1. Refuse while it is open (mmaps keep their file open too), through
+ *    the char device or the block device.
+ * 2. dead goes up before the block device check. A block open past
+ *    asgn1_blk_open() holds open_mutex until it is counted, later ones
+ *    fail, so nothing gets in between the check and del_gendisk().
+ *    A refused destroy takes dead back down.
+ * 3. Unhook it from the table so no new open can find it.
+ * 4. Drop the table's ref, pages go with the last ref.
+ * 5. keep: checkpoint the store one last time for the next load
+ *    (module unload). Otherwise the instance is gone for good and its
+ *    checkpoint image is emptied.
+ */
+static int asgn1_dev_destroy(int minor, bool keep)
+{
+    struct asgn1_dev *dev;
+    bool busy;
+
+    if (minor < 0 || minor >= ASGN1_MAX_DEVS)
+        return -EINVAL;
+
+    mutex_lock(&asgn1_devs_lock);
+    dev = asgn1_devs[minor];
+    if (!dev) {
+        mutex_unlock(&asgn1_devs_lock);
+        return -ENODEV;
+    }
+
+    mutex_lock(&dev->lock);
+    if (atomic_read(&dev->open_count) > 0) {
+        mutex_unlock(&dev->lock);
+        mutex_unlock(&asgn1_devs_lock);
+        return -EBUSY;
+    }
+    WRITE_ONCE(dev->dead, true);
+    mutex_unlock(&dev->lock);
+
+    if (dev->disk) {
+        mutex_lock(&dev->disk->open_mutex);
+        busy = disk_openers(dev->disk);
+        mutex_unlock(&dev->disk->open_mutex);
+        if (busy) {
+            mutex_lock(&dev->lock);
+            WRITE_ONCE(dev->dead, false);
+            mutex_unlock(&dev->lock);
+            mutex_unlock(&asgn1_devs_lock);
+            return -EBUSY;
+        }
+    }
+
+    mutex_lock(&dev->lock);
+    dev->ckpt_discard = !keep;
+    mutex_unlock(&dev->lock);
+    // Queued openers give up their place with ENODEV
+    wake_up_all(&dev->open_wq);
+
+    asgn1_devs[minor] = NULL;
+    mutex_unlock(&asgn1_devs_lock);
+
+    debugfs_remove(dev->debugfs);
+    asgn1_blk_del(dev);
+    device_destroy(asgn1_class, MKDEV(asgn1_major, minor));
+    cdev_del(dev->cdev);
+    kref_put(&dev->ref, asgn1_dev_release);
+
+    pr_info(DRV_NAME ": destroyed instance %d:%d\n", asgn1_major, minor);
+    return 0;
+}
+
+/* ---------- mmap support ---------- */
+
+static inline unsigned long asgn1_pgoff_to_addr(struct vm_area_struct *vma, pgoff_t idx)
+{
+	return vma->vm_start + ((idx - vma->vm_pgoff) << PAGE_SHIFT);
+}
+
+/*
+ * Tie a page about to be mapped to this instance's address_space.
+ * The core write-notify path (page_mkwrite, dirtying, folio_mkclean) works
+ * on folio->mapping and folio->index, like fb_deferred_io does.
+ * asgn1_detach_pages() undoes it when the mapping is handed back.
+ */
+static void asgn1_attach_page(struct asgn1_dev *dev, struct page *page, pgoff_t index)
+{
+    struct folio *folio = page_folio(page);
+
+    if (folio->mapping == dev->mapping)
+        return;
+    folio->index = index - folio_page_idx(folio, page);
+    folio->mapping = dev->mapping;
+}
+
+/*
+* 1. Clear folio->mapping on every stored page attached to mapping, the
+*    last release is about to give the borrowed inode mapping back
+* 2. Shared pages never carry one, compressed entries have no page
+* 3. Caller holds dev->lock and nothing is open, so nothing is mapped
+*/
+static void asgn1_detach_pages(struct asgn1_dev *dev, struct address_space *mapping)
+{
+    unsigned long start, index;
+    void *entry;
+
+    for (start = 0; start < READ_ONCE(dev->end_index); start += ASGN1_WALK_CHUNK) {
+        unsigned long last = start + ASGN1_WALK_CHUNK - 1;
+        struct asgn1_range r;
+
+        asgn1_range_lock(dev, &r, start, last, false);
+        xa_for_each_range(dev->pages, index, entry, start, last) {
+            struct folio *folio;
+
+            if (asgn1_entry_is_zpage(entry) || asgn1_entry_is_shared(entry))
+                continue;
+            folio = page_folio(entry);
+            if (folio->mapping == mapping)
+                folio->mapping = NULL;
+        }
+        asgn1_range_unlock(dev, &r);
+        cond_resched();
+    }
+}
+
+/*
+ * asgn1_map_range - Map device pages [first, last] into vma in bulk.
+ * 1. Gather runs of resident pages, up to ASGN1_MAP_BATCH at a time, and
+ *    insert each run with one vm_insert_pages() call (one PTL round trip).
+ * 2. Index skip is left alone, the fault handler maps it through vmf->page.
+ * 3. Best effort: a run stops at the first PTE that is already present.
+ *    Holes and compressed pages are left for their own faults.
+ * Caller holds [first, last] in the range lock and has clamped it to the
+ * VMA and to EOF. The VMA must be VM_MIXEDMAP. Returns pages mapped.
+ */
+static unsigned long asgn1_map_range(struct asgn1_dev *dev, struct vm_area_struct *vma,
+				     pgoff_t first, pgoff_t last, pgoff_t skip)
+{
+	struct page *batch[ASGN1_MAP_BATCH];
+	unsigned long mapped = 0;
+	pgoff_t idx = first;
+
+	while (idx <= last) {
+		pgoff_t run = idx;
+		unsigned long num = 0, left;
+
+		while (idx <= last && num < ASGN1_MAP_BATCH && idx != skip) {
+			struct page *page = asgn1_peek_page_locked(dev, idx);
+
+			if (!page)
+				break;
+			asgn1_attach_page(dev, page, idx);
+			batch[num++] = page;
+			idx++;
+		}
+		if (num) {
+			left = num;
+			vm_insert_pages(vma, asgn1_pgoff_to_addr(vma, run), batch, &left);
+			mapped += num - left;
+		}
+		/* Step over whatever ended a short run: skip or a missing page */
+		if (num < ASGN1_MAP_BATCH)
+			idx++;
+	}
+
+	asgn1_stat_add(dev, ASGN1_STAT_PREFAULTED, mapped);
+	return mapped;
+}
+
+/*
+ * asgn1_vma_fault - VMA fault handler for mmap'd regions.
+ * 1. Find the page in the device page store corresponding to the fault offset.
+ * 2. Verify the fault is within the device's size, return SIGBUS on error.
+ * 3. Increment the page's refcount and assigns it to the VMF to be mapped.
+ * 4. The page is held shared in the range lock, so faults run in parallel.
+ * 5. Fault-around: also map the rest of the aligned fault_around window.
+ *    Kernel-raised faults (no FAULT_FLAG_USER: MAP_POPULATE, mlock, GUP)
+ *    map up to ASGN1_POPULATE_PAGES ahead instead, so populating a whole
+ *    mapping costs one trap per window rather than one per page.
+ * 6. Shared writable mappings may fault past EOF: the page is allocated
+ *    (zeroed) here, size_bytes only grows once it is written, in
+ *    asgn1_vma_page_mkwrite().
+ * 7. Holes: read faults map the shared zero page (VM_MIXEDMAP only, the
+ *    way DAX maps holes), write faults and huge instances allocate.
+ * 8. Deduplicated pages: read faults map the shared page read-only and
+ *    leave it unattached, shared write faults unshare it first.
+ */
+static vm_fault_t asgn1_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct asgn1_dev *dev = vma->vm_private_data;
+	struct page *page;
+	struct asgn1_range r;
+	size_t page_index = vmf->pgoff;
+	pgoff_t first = page_index, last = page_index;
+	size_t size = asgn1_size(dev);
+	bool grow = (vma->vm_flags & (VM_SHARED | VM_WRITE)) == (VM_SHARED | VM_WRITE);
+	bool write = (vmf->flags & FAULT_FLAG_WRITE) && (vma->vm_flags & VM_SHARED);
+	u64 t0 = ktime_get_ns();
+	bool beyond;
+	vm_fault_t ret = VM_FAULT_SIGBUS; /* Default error */
+
+	/*
+	 * Check if the fault is within the logical size of the device.
+	 * The VMA may be larger than the current file size.
+	 */
+	if (page_index * PAGE_SIZE >= size && !grow)
+		return ret;
+
+	/* Work out the fault-around window, clamped to the VMA and EOF */
+	if ((vma->vm_flags & VM_MIXEDMAP) && page_index * PAGE_SIZE < size) {
+		if (!(vmf->flags & FAULT_FLAG_USER)) {
+			last = page_index + ASGN1_POPULATE_PAGES - 1;
+		} else {
+			unsigned int nr = READ_ONCE(dev->fault_around);
+
+			first = ALIGN_DOWN(page_index, nr);
+			last = first + nr - 1;
+		}
+		first = max_t(pgoff_t, first, vma->vm_pgoff);
+		last = min_t(pgoff_t, last, vma->vm_pgoff + vma_pages(vma) - 1);
+		last = min_t(pgoff_t, last, (size - 1) >> PAGE_SHIFT);
+	}
+
+	asgn1_range_lock(dev, &r, first, last, false);
+
+	/* Re-check, a truncate may have run before we got the range */
+	beyond = page_index * PAGE_SIZE >= asgn1_size(dev);
+	if (beyond) {
+		if (!grow)
+			goto out;
+		first = last = page_index;  /* no fault-around past EOF */
+	}
+
+	page = asgn1_get_nth_page_locked(dev, page_index);
+	if (!page && !(vmf->flags & FAULT_FLAG_WRITE) && (vma->vm_flags & VM_MIXEDMAP)) {
+		ret = vmf_insert_mixed(vma, vmf->address & PAGE_MASK,
+				       asgn1_zero_pfn(vmf->address));
+		if (ret & VM_FAULT_ERROR)
+			goto out;
+		atomic_long_inc(&dev->hole_maps);
+		goto around;
+	}
+	if (!page) {
+		if (asgn1_ensure_range_locked(dev, page_index, page_index)) {
+			ret = VM_FAULT_OOM;
+			goto out;
+		}
+		if (beyond)
+			atomic_long_inc(&dev->mmap_grown);
+		page = asgn1_get_nth_page_locked(dev, page_index);
+	}
+	if (write && asgn1_index_is_shared(dev, page_index)) {
+		page = asgn1_unshare_locked(dev, page_index);
+		if (!page) {
+			ret = VM_FAULT_OOM;
+			goto out;
+		}
+	}
+
+	get_page(page); /* Increment page reference count before handing to MM */
+	if (!asgn1_index_is_shared(dev, page_index))
+		asgn1_attach_page(dev, page, page_index);
+	vmf->page = page;
+	ret = 0; /* Success (VM_FAULT_NOPAGE) */
+	asgn1_stat_add(dev, ASGN1_STAT_PTE_FAULTS, 1);
+
+around:
+	if (first != last)
+		asgn1_map_range(dev, vma, first, last, page_index);
+
+out:
+	asgn1_range_unlock(dev, &r);
+	asgn1_account(dev, ASGN1_OP_FAULT, t0, 0);
+	trace_asgn1_fault(dev->minor, page_index, first, last, write, r.wait_ns, ret);
+	return ret;
+}
+
+#ifdef ASGN1_PMD_MAP
+/*
+ * asgn1_vma_huge_fault - Map a whole huge extent with one PMD.
+ * 1. The 2 MiB virtual block must lie inside the VMA and line up with an
+ *    extent boundary in the device, and the extent must be below EOF.
+ * 2. The extent must be one compound folio (not order-0 fallback pages),
+ *    and not shared with a snapshot.
+ * 3. Anything else falls back to asgn1_vma_fault(), one PTE at a time.
+ */
+static vm_fault_t asgn1_vma_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct asgn1_dev *dev = vma->vm_private_data;
+	unsigned long haddr = vmf->address & PMD_MASK;
+	pgoff_t first = vmf->pgoff - ((vmf->address - haddr) >> PAGE_SHIFT);
+	struct asgn1_range r;
+	struct page *page;
+	u64 t0 = ktime_get_ns();
+	vm_fault_t ret = VM_FAULT_FALLBACK;
+
+	if (order != ASGN1_HPAGE_ORDER)
+		return VM_FAULT_FALLBACK;
+	if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	if (!IS_ALIGNED(first, ASGN1_HPAGE_NR))
+		return VM_FAULT_FALLBACK;
+	if ((first + ASGN1_HPAGE_NR) * PAGE_SIZE > asgn1_size(dev))
+		return VM_FAULT_FALLBACK;
+
+	asgn1_range_lock(dev, &r, first, first + ASGN1_HPAGE_NR - 1, false);
+
+	/* Re-check, a truncate may have run before we got the range */
+	if ((first + ASGN1_HPAGE_NR) * PAGE_SIZE > asgn1_size(dev))
+		goto out;
+
+	page = asgn1_get_nth_page_locked(dev, first);
+	if (!page || !PageHead(page) || compound_order(page) != ASGN1_HPAGE_ORDER ||
+	    asgn1_index_is_shared(dev, first))
+		goto out;
+
+	/*
+	 * PMD mappings get no page_mkwrite, shared write faults (first touch
+	 * and write-protect upgrades alike) come through here instead.
+	 */
+	asgn1_attach_page(dev, page, first);
+	if (vmf->flags & FAULT_FLAG_WRITE) {
+		unsigned long i;
+
+		for (i = 0; i < ASGN1_HPAGE_NR; i++)
+			asgn1_mark_dirty(dev, first + i);
+	}
+
+	/* Takes its own folio reference for the mapping */
+	ret = vmf_insert_folio_pmd(vmf, page_folio(page), vmf->flags & FAULT_FLAG_WRITE);
+	if (!(ret & VM_FAULT_ERROR))
+		asgn1_stat_add(dev, ASGN1_STAT_PMD_FAULTS, 1);
+
+out:
+	asgn1_range_unlock(dev, &r);
+	/* A fallback is timed by the PTE fault that follows */
+	if (ret != VM_FAULT_FALLBACK)
+		asgn1_account(dev, ASGN1_OP_FAULT, t0, 0);
+	return ret;
+}
+#endif
+
+/*
+ * asgn1_vma_page_mkwrite - First write to a page of a shared mapping.
+ * 1. Mappings of a shared writable VMA start write-protected (write-notify),
+ *    so every page's first store after mapping or cleaning lands here.
+ * 2. Mark the page dirty. A page at or past EOF (mmap grow) extends
+ *    size_bytes to its end, a store into the partial last page does not.
+ * 3. If the page left the store meanwhile (truncate), retry the fault.
+ *    A deduplicated page is still mapped read-only: zap it, so the retry
+ *    comes back through asgn1_vma_fault() as a write and unshares it.
+ */
+static vm_fault_t asgn1_vma_page_mkwrite(struct vm_fault *vmf)
+{
+	struct asgn1_dev *dev = vmf->vma->vm_private_data;
+	struct folio *folio = page_folio(vmf->page);
+	pgoff_t page_index = vmf->pgoff;
+	struct asgn1_range r;
+
+	asgn1_range_lock(dev, &r, page_index, page_index, false);
+
+	if (asgn1_peek_page_locked(dev, page_index) != vmf->page) {
+		asgn1_range_unlock(dev, &r);
+		unmap_mapping_range(vmf->vma->vm_file->f_mapping,
+				    (loff_t)page_index << PAGE_SHIFT, PAGE_SIZE, 0);
+		return VM_FAULT_NOPAGE;
+	}
+
+	asgn1_mark_dirty(dev, page_index);
+	if (page_index >= DIV_ROUND_UP(asgn1_size(dev), PAGE_SIZE))
+		asgn1_extend_size(dev, (size_t)(page_index + 1) << PAGE_SHIFT);
+	file_update_time(vmf->vma->vm_file);
+
+	/* The core would lock it and insist on ->mapping, save it the trip */
+	folio_lock(folio);
+	asgn1_range_unlock(dev, &r);
+	return VM_FAULT_LOCKED;
+}
+
+/*
+ * asgn1_vma_pfn_mkwrite - Write to a hole mapped with the zero page.
+ * The zero page is the only thing mapped by pfn here. Zap it so the store
+ * retries as a write fault, which allocates the page.
+ */
+static vm_fault_t asgn1_vma_pfn_mkwrite(struct vm_fault *vmf)
+{
+	unmap_mapping_range(vmf->vma->vm_file->f_mapping,
+			    (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+	return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct asgn1_vm_ops = {
+	.fault = asgn1_vma_fault,
+	.page_mkwrite = asgn1_vma_page_mkwrite,
+	.pfn_mkwrite = asgn1_vma_pfn_mkwrite,
+#ifdef ASGN1_PMD_MAP
+	.huge_fault = asgn1_vma_huge_fault,
+#endif
+};
+
+static int asgn1_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct asgn1_dev *dev = asgn1_file_dev(filp);
+
+	vma->vm_ops = &asgn1_vm_ops;
+	vma->vm_private_data = dev;
+
+	/*
+	 * Huge instances: lets huge_fault run even when THP is in "madvise"
+	 * mode. Others: VM_MIXEDMAP lets the fault handler and fadvise insert
+	 * neighbouring pages with vm_insert_pages() under mmap_lock for read.
+	 */
+	if (READ_ONCE(dev->huge))
+		vm_flags_set(vma, VM_HUGEPAGE);
+	else
+		vm_flags_set(vma, VM_MIXEDMAP);
+	return 0;
+}
+
+/*
+ * asgn1_fadvise - madvise(MADV_WILLNEED) and posix_fadvise(WILLNEED).
+ * 1. Find this process's mappings of filp that overlap the range.
+ * 2. Map every resident page of the overlap now, in bulk, so later
+ *    accesses don't trap at all.
+ * madvise() drops mmap_lock before calling here, so we can take it.
+ * Other advice has nothing to act on for a ramdisk and is accepted.
+ */
+static int asgn1_fadvise(struct file *filp, loff_t offset, loff_t len, int advice)
+{
+	struct asgn1_dev *dev = asgn1_file_dev(filp);
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	size_t size = asgn1_size(dev);
+	pgoff_t first, last;
+
+	if (advice != POSIX_FADV_WILLNEED || !mm)
+		return 0;
+	if (offset < 0 || len < 0)
+		return -EINVAL;
+	if (!size || offset >= size)
+		return 0;
+
+	first = offset >> PAGE_SHIFT;
+	if (!len || offset + len > size)
+		last = (size - 1) >> PAGE_SHIFT;
+	else
+		last = (offset + len - 1) >> PAGE_SHIFT;
+
+	mmap_read_lock(mm);
+	{
+		VMA_ITERATOR(vmi, mm, 0);
+
+		for_each_vma(vmi, vma) {
+			pgoff_t vfirst, vlast;
+			struct asgn1_range r;
+
+			if (vma->vm_file != filp || !(vma->vm_flags & VM_MIXEDMAP))
+				continue;
+			vfirst = max_t(pgoff_t, first, vma->vm_pgoff);
+			vlast = min_t(pgoff_t, last, vma->vm_pgoff + vma_pages(vma) - 1);
+			if (vfirst > vlast)
+				continue;
+
+			asgn1_range_lock(dev, &r, vfirst, vlast, false);
+			vlast = min_t(pgoff_t, vlast, (asgn1_size(dev) - 1) >> PAGE_SHIFT);
+			if (asgn1_size(dev) && vfirst <= vlast)
+				asgn1_map_range(dev, vma, vfirst, vlast, ULONG_MAX);
+			asgn1_range_unlock(dev, &r);
+		}
+	}
+	mmap_read_unlock(mm);
+	return 0;
+}
+
+/* ---------- File ops related ---------- */
+
+/*
+* Pages live in the xarray, not the page cache, the mapping only anchors
+* folio->mapping for the write-notify path. Dirtying is tracked with
+* ASGN1_MARK_DIRTY, so the generic dirty accounting is skipped.
+*/
+static const struct address_space_operations asgn1_aops = {
+    .dirty_folio = noop_dirty_folio,
+};
+
+// An opener queued on open_waiters, lives on its stack
+struct asgn1_open_waiter {
+    struct list_head node;
+    bool admitted;
+};
+
+static inline bool asgn1_open_full(struct asgn1_dev *dev)
+{
+    int max_users = READ_ONCE(dev->max_users);
+
+    return max_users > 0 && atomic_read(&dev->open_count) >= max_users;
+}
+
+/*
+* Hand free slots to queued openers, oldest first. Called under dev->lock
+* whenever open_count drops or max_users rises. The slot is counted in
+* open_count before the waiter runs, so nobody can take it in between.
+*/
+static void asgn1_admit_locked(struct asgn1_dev *dev)
+{
+    struct asgn1_open_waiter *w;
+    bool woke = false;
+
+    while (!asgn1_open_full(dev)) {
+        w = list_first_entry_or_null(&dev->open_waiters, struct asgn1_open_waiter, node);
+        if (!w)
+            break;
+        list_del_init(&w->node);
+        dev->open_queued--;
+        atomic_inc(&dev->open_count);
+        WRITE_ONCE(w->admitted, true);
+        woke = true;
+    }
+    if (woke)
+        wake_up_all(&dev->open_wq);
+}
+
+/*
+* 1. Queue behind every earlier opener and sleep until admitted
+* 2. Called and returns with dev->lock held, sleeps without it
+* 3. 0 once admitted, the slot is already in open_count
+* 4. A signal or the instance being destroyed gives the place up
+*/
+static int asgn1_open_wait(struct asgn1_dev *dev)
+{
+    struct asgn1_open_waiter w = { .admitted = false };
+    u64 t0 = ktime_get_ns();
+    u64 ns;
+
+    list_add_tail(&w.node, &dev->open_waiters);
+    dev->open_queued++;
+    dev->open_queued_max = max(dev->open_queued_max, dev->open_queued);
+    mutex_unlock(&dev->lock);
+
+    wait_event_interruptible(dev->open_wq,
+                             READ_ONCE(w.admitted) || READ_ONCE(dev->dead));
+
+    mutex_lock(&dev->lock);
+    // Admitted while a signal or the destroy came in: keep the slot
+    if (!w.admitted) {
+        list_del(&w.node);
+        dev->open_queued--;
+        return dev->dead ? -ENODEV : -ERESTARTSYS;
+    }
+
+    ns = ktime_get_ns() - t0;
+    dev->open_waited++;
+    dev->open_wait_ns += ns;
+    dev->open_wait_max_ns = max(dev->open_wait_max_ns, ns);
+    return 0;
+}
+
+/*
+* 1. Find the instance for this minor and pin it
+* 2. Open file, validate max concurrent users
+* 3. At the limit, queue for a slot in arrival order, O_NONBLOCK fails with EBUSY
+* 4. The first open borrows the inode's mapping and its a_ops, the last
+*    release detaches the store pages from it and gives both back
+*/
+static int asgn1_open(struct inode *inode, struct file *filp)
+{
+    struct asgn1_dev *dev;
+    struct asgn1_file *af;
+    int flags = filp->f_flags;
+    unsigned int minor = iminor(inode);
+    bool admitted = false;
+    int rc = 0;
+
+    af = kzalloc(sizeof(*af), GFP_KERNEL);
+    if (!af)
+        return -ENOMEM;
+
+    mutex_lock(&asgn1_devs_lock);
+    dev = minor < ASGN1_MAX_DEVS ? asgn1_devs[minor] : NULL;
+    if (dev)
+        kref_get(&dev->ref);
+    mutex_unlock(&asgn1_devs_lock);
+    if (!dev) {
+        kfree(af);
+        return -ENODEV;
+    }
+
+    mutex_lock(&dev->lock);
+
+    // Destroyed between the lookup and here
+    if (dev->dead) {
+        rc = -ENODEV;
+        goto out;
+    }
+
+    // At the limit, or others already queued: no overtaking them
+    if (asgn1_open_full(dev) || !list_empty(&dev->open_waiters)) {
+        if (flags & O_NONBLOCK) {
+            dev->open_rejected++;
+            rc = -EBUSY;
+            goto out;
+        }
+        rc = asgn1_open_wait(dev);
+        if (rc)
+            goto out;
+        admitted = true;
+    }
+
+    // Truncating opens are refused under a filesystem on the block device
+    if ((flags & O_ACCMODE) == O_WRONLY && !(flags & O_APPEND) && dev->disk && disk_openers(dev->disk)) {
+        // Pass the slot on to the next in line
+        if (admitted) {
+            atomic_dec(&dev->open_count);
+            asgn1_admit_locked(dev);
+        }
+        rc = -EBUSY;
+        goto out;
+    }
+
+    if (!admitted)
+        atomic_inc(&dev->open_count);
+    af->dev = dev;
+    filp->private_data = af;
+    filp->f_mode |= FMODE_NOWAIT;   // read_iter/write_iter honour IOCB_NOWAIT
+
+    // All opens share one address_space, whichever node they came through
+    if (!dev->mapping) {
+        ihold(inode);
+        dev->mapping = inode->i_mapping;
+        dev->mapping_aops = dev->mapping->a_ops;
+        dev->mapping->a_ops = &asgn1_aops;
+    }
+    filp->f_mapping = dev->mapping;
+
+    // fresh write and no append (drop all pages, big stores are freed in the background)
+    if ((flags & O_ACCMODE) == O_WRONLY && !(flags & O_APPEND)) {
+        struct asgn1_range r;
+
+        asgn1_range_lock(dev, &r, 0, ASGN1_RANGE_ALL, true);
+        asgn1_truncate_locked(dev);
+        asgn1_range_unlock(dev, &r);
+    }
+
+out:
+    mutex_unlock(&dev->lock);
+    if (rc) {
+        kref_put(&dev->ref, asgn1_dev_release);
+        kfree(af);
+    }
+    return rc;
+}
+
+static int asgn1_release(struct inode *inode, struct file *filp)
+{
+    struct asgn1_dev *dev = asgn1_file_dev(filp);
+    struct address_space *mapping = NULL;
+
+    // Mappings hold the file, so the last release means nothing is mapped
+    mutex_lock(&dev->lock);
+    if (atomic_dec_and_test(&dev->open_count)) {
+        mapping = dev->mapping;
+        dev->mapping = NULL;
+        // The inode outlives us (devtmpfs), hand it back as we found it
+        asgn1_detach_pages(dev, mapping);
+        mapping->a_ops = dev->mapping_aops;
+    }
+    asgn1_admit_locked(dev);
+    mutex_unlock(&dev->lock);
+
+    if (mapping)
+        iput(mapping->host);
+    kref_put(&dev->ref, asgn1_dev_release);
+    kfree(filp->private_data);
+    return 0;
+}
+
+/*
+* 1. Handles start, current and end positions
+* 2. Validate the new position
+* 3. Lockless, SEEK_END uses a snapshot of size_bytes
+* 4. SEEK_DATA/SEEK_HOLE see holes in the sparse store
+*/
+static loff_t asgn1_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct asgn1_dev *dev = asgn1_file_dev(filp);
+    loff_t newpos;
+
+    switch (whence) {
+    case SEEK_SET:
+        newpos = off;
+        break;
+    case SEEK_CUR:
+        newpos = filp->f_pos + off;
+        break;
+    case SEEK_END:
+        newpos = (loff_t)asgn1_size(dev) + off;
+        break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        newpos = asgn1_seek_data_hole(dev, off, whence);
+        if (newpos < 0)
+            return newpos;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (newpos < 0)
+        return -EINVAL;
+
+    filp->f_pos = newpos;
+    return newpos;
+}
+
+/*
+ * Take [first, last] of the range lock for a kiocb.
+ * IOCB_NOWAIT callers (io_uring inline issue, preadv2 RWF_NOWAIT) get
+ * -EAGAIN instead of sleeping on a conflicting holder.
+ */
+static int asgn1_range_lock_iocb(struct asgn1_dev *dev, struct kiocb *iocb,
+                                 struct asgn1_range *r, pgoff_t first, pgoff_t last,
+                                 bool excl)
+{
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return asgn1_range_trylock(dev, r, first, last, excl) ? 0 : -EAGAIN;
+
+    asgn1_range_lock(dev, r, first, last, excl);
+    return 0;
+}
+
+/*
+ * Paged copy of [pos, pos + count) into an iov_iter, the read_iter loop.
+ * 1. Holes copy out as zeros.
+ * 2. nowait: stop with -EAGAIN at a compressed page, decompressing it
+ *    allocates a page.
+ * 3. Returns the bytes copied, or the error (-EFAULT for a bad user
+ *    address) that stopped it before the first byte.
+ * 4. Caller holds the range and has clipped count to the size.
+ */
+static ssize_t asgn1_copy_to_iter_locked(struct asgn1_dev *dev, size_t pos, size_t count,
+                                         struct iov_iter *to, bool nowait)
+{
+    ssize_t done = 0;
+
+    while (count) {
+        size_t page_index = pos >> PAGE_SHIFT;
+        size_t page_off   = pos & (PAGE_SIZE - 1);
+        size_t chunk      = min(count, PAGE_SIZE - page_off);
+        struct page *page;
+        size_t copied;
+
+        if (nowait && asgn1_index_is_zpage(dev, page_index))
+            return done ? done : -EAGAIN;
+        page = asgn1_get_nth_page_locked(dev, page_index);
+
+        // Maps the page itself, and copes with user, kernel and bvec iters
+        if (page)
+            copied = copy_page_to_iter(page, page_off, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+
+        pos += copied;
+        done += copied;
+        count -= copied;
+        if (copied < chunk)
+            return done ? done : -EFAULT;
+    }
+    return done;
+}
+
+/*
+ * Paged copy of an iov_iter into [pos, pos + count), the write_iter loop.
+ * 1. Every page must exist already (asgn1_ensure_range_locked()), shared
+ *    ones are unshared on the way.
+ * 2. nowait: stop with -EAGAIN at a hole, a shared or a compressed page
+ *    instead, as getting a page there allocates.
+ * 3. Returns the bytes copied, or the error that stopped it before the
+ *    first byte. Doesn't touch the size.
+ * 4. Caller holds the range exclusively.
+ */
+static ssize_t asgn1_copy_from_iter_locked(struct asgn1_dev *dev, size_t pos, size_t count,
+                                           struct iov_iter *from, bool nowait)
+{
+    ssize_t done = 0;
+    int rc = 0;
+
+    while (count) {
+        size_t page_index = pos >> PAGE_SHIFT;
+        size_t page_off   = pos & (PAGE_SIZE - 1);
+        size_t chunk      = min(count, PAGE_SIZE - page_off);
+        struct page *page;
+        size_t copied;
+
+        if (nowait && (asgn1_index_is_shared(dev, page_index) ||
+                       asgn1_index_is_zpage(dev, page_index)))
+            page = NULL;
+        else
+            page = asgn1_get_nth_page_write_locked(dev, page_index);
+        if (!page) {
+            rc = nowait ? -EAGAIN : -EIO;
+            break;
+        }
+
+        // Copy the chunk from the iterator to kern
+        copied = copy_page_from_iter(page, page_off, chunk, from);
+        if (copied)
+            asgn1_mark_dirty(dev, page_index);
+
+        pos += copied;
+        done += copied;
+        count -= copied;
+        if (copied < chunk) {
+            rc = -EFAULT;
+            break;
+        }
+    }
+    return done ? done : rc;
+}
+
+/*
+* 1. A read found pos at EOF. Returns 0 for EOF, 1 once data is there
+* 2. Without follow mode that is plain EOF
+* 3. Follow mode waits for the size to grow past pos, or fails with
+*    EAGAIN for O_NONBLOCK and RWF_NOWAIT
+*/
+static int asgn1_follow_wait(struct asgn1_dev *dev, struct kiocb *iocb, size_t pos)
+{
+    struct asgn1_file *af = iocb->ki_filp->private_data;
+
+    if (!READ_ONCE(af->follow))
+        return 0;
+    if ((iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK))
+        return -EAGAIN;
+
+    atomic_long_inc(&dev->follow_waits);
+    if (wait_event_interruptible(dev->data_wq,
+                                 asgn1_size(dev) > pos || !READ_ONCE(af->follow)))
+        return -ERESTARTSYS;
+    return asgn1_size(dev) > pos;
+}
+
+/*
+ * Read data from the ramdisk into an iov_iter.
+ * 1. Handle EOF by returning 0 if the read position is at or beyond file size,
+ *    or in follow mode by waiting, see asgn1_follow_wait().
+ * 2. Iterate through the pages, copying data chunks into the iterator, the
+ *    whole iovec array (readv, preadv2, io_uring) under one range lock.
+ * 3. Update the file position (iocb->ki_pos) by the number of bytes read.
+ * 4. Pages are held shared, so readers only wait for overlapping writers.
+ * 5. Holes read as zeros, nothing is allocated for them.
+ * 6. IOCB_NOWAIT reads get -EAGAIN (or a short read) at a compressed
+ *    page, decompressing allocates.
+ */
+static ssize_t asgn1_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct asgn1_dev *dev = asgn1_file_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(to);
+    u64 t0 = ktime_get_ns();
+    ssize_t ret;
+    size_t pos, size;
+    struct asgn1_range r;
+    int rc = 0;
+
+    if (!count)
+        return 0;
+    if (iocb->ki_pos < 0)
+        return -EINVAL;
+
+    pos = (size_t)iocb->ki_pos;
+again:
+    // If reading beyond current logical size, return 0 (EOF) or follow
+    if (pos >= asgn1_size(dev)) {
+        rc = asgn1_follow_wait(dev, iocb, pos);
+        if (rc <= 0)
+            return rc;
+    }
+
+    rc = asgn1_range_lock_iocb(dev, iocb, &r, pos >> PAGE_SHIFT,
+                               (pos + count - 1) >> PAGE_SHIFT, false);
+    if (rc)
+        return rc;
+
+    // Size may have shrunk (truncate) before we got the range
+    size = asgn1_size(dev);
+    if (pos >= size) {
+        asgn1_range_unlock(dev, &r);
+        goto again;
+    }
+
+    // Read only upto available data
+    if (pos + count > size)
+        count = size - pos;
+
+    ret = asgn1_copy_to_iter_locked(dev, pos, count, to, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret > 0)
+        iocb->ki_pos += ret;
+
+    asgn1_range_unlock(dev, &r);
+    asgn1_account(dev, ASGN1_OP_READ, t0, max_t(ssize_t, ret, 0));
+    trace_asgn1_read(dev->minor, pos, count, r.wait_ns, ret);
+    return ret;
+}
+
+
+/*
+ * asgn1_write_iter - Write data to the ramdisk.
+ * 1. Allocate pages for the holes this write covers, and only those.
+ * 2. Copy data from the iov_iter into the correct page(s) at the offset.
+ * 3. Update the file position and the total size of the ramdisk.
+ * 4. Only the pages being written are held, exclusively.
+ * 5. IOCB_NOWAIT writes that would have to grow the store, unshare a
+ *    deduplicated page or decompress one get -EAGAIN: page allocation and
+ *    grow_lock may sleep.
+ * 6. O_APPEND writes go to the size at the time the range is held.
+ */
+static ssize_t asgn1_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    int flags = filp->f_flags;
+    struct asgn1_dev *dev = asgn1_file_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    u64 t0 = ktime_get_ns();
+    ssize_t ret;
+    size_t pos;
+    struct asgn1_range r;
     int rc = 0;
 
-    mutex_lock(&gdev.lock);
+    if (!count)
+        return 0;
+    if (iocb->ki_pos < 0)
+        return -EINVAL;
 
-    if (gdev.max_users > 0 && atomic_read(&gdev.open_count) >= gdev.max_users) {
-        rc = -EBUSY;
-        goto out;
+    pos = (size_t)iocb->ki_pos;
+again:
+    // O_APPEND writes at EOF, appenders racing for the same EOF retry
+    if (iocb->ki_flags & IOCB_APPEND)
+        pos = asgn1_size(dev);
+    rc = asgn1_range_lock_iocb(dev, iocb, &r, pos >> PAGE_SHIFT,
+                               (pos + count - 1) >> PAGE_SHIFT, true);
+    if (rc)
+        return rc;
+    if ((iocb->ki_flags & IOCB_APPEND) && asgn1_size(dev) != pos) {
+        asgn1_range_unlock(dev, &r);
+        goto again;
     }
 
-    atomic_inc(&gdev.open_count);
-
-    // fresh write and no append (free all pages)
-    if ((flags & O_ACCMODE) == O_WRONLY) {
-        asgn1_free_all_pages_locked(&gdev);
+    // Ensure pages exist under this write, NOWAIT stops at the first hole
+    if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+	// Avoid incomplete writes
+        rc = asgn1_ensure_range_locked(dev, pos >> PAGE_SHIFT,
+                                       (pos + count - 1) >> PAGE_SHIFT);
+        if (rc) {
+            asgn1_range_unlock(dev, &r);
+            return rc;
+        }
     }
 
-out:
-    mutex_unlock(&gdev.lock);
-    return rc;
-}
+    // Perform paged write
+    ret = asgn1_copy_from_iter_locked(dev, pos, count, from, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret > 0) {
+        iocb->ki_pos = pos + ret;
+        asgn1_extend_size(dev, (size_t)iocb->ki_pos);
+    }
 
-static int asgn1_release(struct inode *inode, struct file *filp)
-{
-    atomic_dec(&gdev.open_count);
-    return 0;
+    asgn1_range_unlock(dev, &r);
+    asgn1_account(dev, ASGN1_OP_WRITE, t0, max_t(ssize_t, ret, 0));
+    trace_asgn1_write(dev->minor, pos, count, r.wait_ns, ret);
+    return ret;
 }
 
 /*
-* 1. Handles start, current and end positions
-* 2. Validate the new position
+* Pipe buffers that point straight at store pages.
+* 1. Each one holds its own page reference, so truncate can't free it.
+* 2. No try_steal: the page is still part of the device, a consumer that
+*    took it over would corrupt the image.
 */
-static loff_t asgn1_llseek(struct file *filp, loff_t off, int whence)
-{
-    loff_t newpos;
-
-    mutex_lock(&gdev.lock);
-
-    switch (whence) {
-    case SEEK_SET:
-        newpos = off;
-        break;
-    case SEEK_CUR:
-        newpos = filp->f_pos + off;
-        break;
-    case SEEK_END:
-        newpos = (loff_t)gdev.size_bytes + off;
-        break;
-    default:
-        mutex_unlock(&gdev.lock);
-        return -EINVAL;
-    }
+static const struct pipe_buf_operations asgn1_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get     = generic_pipe_buf_get,
+};
 
-    if (newpos < 0) {
-        mutex_unlock(&gdev.lock);
-        return -EINVAL;
-    }
+// Holes go out as the zero page, which is never refcounted or stolen
+static void asgn1_zero_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+}
 
-    filp->f_pos = newpos;
-    mutex_unlock(&gdev.lock);
-    return newpos;
+static bool asgn1_zero_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+    return true;
 }
 
+static const struct pipe_buf_operations asgn1_zero_buf_ops = {
+    .release = asgn1_zero_buf_release,
+    .get     = asgn1_zero_buf_get,
+};
+
 /*
- * Read data from the ramdisk into a user-space buffer.
- * 1. Handle EOF by returning 0 if the read position is at or beyond file size.
- * 2. Iterate through the pages, copying data chunks to the user buffer.
- * 3. Update the file position pointer (*ppos) by the number of bytes read.
+ * asgn1_splice_read - splice()/sendfile() out of the ramdisk, zero copy.
+ * 1. Clamp to EOF and to the free slots in the pipe.
+ * 2. Hand each store page to the pipe by reference, one buffer per page.
+ * 3. The pages are only held shared while they're queued, not while they
+ *    sit in the pipe. A later write to the range shows up in data not yet
+ *    consumed, the same as splicing from the page cache.
+ * 4. SPLICE_F_NONBLOCK gets -EAGAIN rather than waiting on a writer.
+ * 5. Holes are spliced as the shared zero page.
  */
-static ssize_t asgn1_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+static ssize_t asgn1_splice_read(struct file *in, loff_t *ppos,
+                                 struct pipe_inode_info *pipe, size_t len,
+                                 unsigned int flags)
 {
-    ssize_t read_total = 0;
-    size_t pos, remaining;
-    int rc = 0;
-
-    if (!count)
-        return 0;
-
-    mutex_lock(&gdev.lock);
+    struct asgn1_dev *dev = asgn1_file_dev(in);
+    ssize_t spliced = 0, ret = 0;
+    size_t pos, size, slots;
+    struct asgn1_range r;
 
-    // If reading beyond current logical size, return 0 (EOF)
-    if (*ppos >= gdev.size_bytes) {
-        mutex_unlock(&gdev.lock);
+    if (*ppos < 0)
+        return -EINVAL;
+    if (!len || *ppos >= asgn1_size(dev))
         return 0;
-    }
-
-    // Read only upto available data
-    if (*ppos + count > gdev.size_bytes)
-        count = gdev.size_bytes - *ppos;
 
-    remaining = count;
     pos = (size_t)*ppos;
+    slots = pipe->max_usage - pipe_occupancy(pipe->head, pipe->tail);
+    if (!slots)
+        return -EAGAIN;
+    len = min(len, (slots << PAGE_SHIFT) - (pos & (PAGE_SIZE - 1)));
 
-    while (remaining) {
-        size_t page_index = pos >> PAGE_SHIFT;
-        size_t page_off   = pos & (PAGE_SIZE - 1);
-        size_t chunk      = min(remaining, PAGE_SIZE - page_off);
-        struct page_node *pn = asgn1_get_nth_page_locked(&gdev, page_index);
-        void *kaddr;
+    if (flags & SPLICE_F_NONBLOCK) {
+        if (!asgn1_range_trylock(dev, &r, pos >> PAGE_SHIFT,
+                                 (pos + len - 1) >> PAGE_SHIFT, false))
+            return -EAGAIN;
+    } else {
+        asgn1_range_lock(dev, &r, pos >> PAGE_SHIFT,
+                         (pos + len - 1) >> PAGE_SHIFT, false);
+    }
 
-        if (!pn || !pn->page) { // should not happen if size_bytes is correct
-            rc = -EIO;
-            break;
-        }
+    // Size may have shrunk (truncate) before we got the range
+    size = asgn1_size(dev);
+    if (pos < size)
+        len = min(len, size - pos);
+    else
+        len = 0;
 
-	// Physical address
-        kaddr = asgn1_kmap_local(pn->page);
+    while (len) {
+        size_t page_off = pos & (PAGE_SIZE - 1);
+        size_t chunk = min(len, PAGE_SIZE - page_off);
+        struct page *page = asgn1_get_nth_page_locked(dev, pos >> PAGE_SHIFT);
+        struct pipe_buffer buf = {
+            .ops    = page ? &asgn1_pipe_buf_ops : &asgn1_zero_buf_ops,
+            .page   = page ? page : ZERO_PAGE(0),
+            .offset = page_off,
+            .len    = chunk,
+        };
 
-	// Copy from kernel memory space to user memory space
-        if (copy_to_user(buf + read_total, (char *)kaddr + page_off, chunk)) {
-            kunmap_local(kaddr);
-            rc = -EFAULT;
+        // add_to_pipe() drops this reference itself when it fails
+        if (page)
+            get_page(page);
+        ret = add_to_pipe(pipe, &buf);
+        if (ret < 0)
             break;
-        }
-        asgn1_kunmap_local(kaddr);
 
         pos += chunk;
-        read_total += chunk;
-        remaining -= chunk;
+        spliced += chunk;
+        len -= chunk;
     }
 
-    if (read_total > 0)
-        *ppos += read_total;
+    asgn1_range_unlock(dev, &r);
 
-    mutex_unlock(&gdev.lock);
-    return rc ? rc : read_total;
+    *ppos += spliced;
+    return spliced ? spliced : ret;
 }
 
+/*
+* 1. Zero the bytes [offset, end), shared by fallocate and block discards
+* 2. Partial pages at either end are zeroed in place, the whole pages in
+*    between are unmapped and dropped from the store
+* 3. Caller holds the whole byte range exclusively
+*/
+static void asgn1_zero_range_locked(struct asgn1_dev *dev, loff_t offset, loff_t end)
+{
+    pgoff_t head = offset >> PAGE_SHIFT, tail = (end - 1) >> PAGE_SHIFT;
+    pgoff_t first, last;
+    struct page *page;
+
+    // Partial head and tail pages, only those are unshared or decompressed
+    if (offset & ~PAGE_MASK) {
+        page = asgn1_get_nth_page_write_locked(dev, head);
+        if (page) {
+            memzero_page(page, offset & ~PAGE_MASK,
+                         min_t(loff_t, end, round_up(offset + 1, PAGE_SIZE)) - offset);
+            asgn1_mark_dirty(dev, head);
+        }
+    }
+    // An aligned head ending inside its own page is the tail
+    if ((end & ~PAGE_MASK) && !(tail == head && (offset & ~PAGE_MASK))) {
+        page = asgn1_get_nth_page_write_locked(dev, tail);
+        if (page) {
+            memzero_page(page, 0, end & ~PAGE_MASK);
+            asgn1_mark_dirty(dev, tail);
+        }
+    }
+
+    // Whole pages in between
+    first = round_up(offset, PAGE_SIZE) >> PAGE_SHIFT;
+    last = end >> PAGE_SHIFT;
+    if (first < last) {
+        if (dev->mapping)
+            unmap_mapping_range(dev->mapping, (loff_t)first << PAGE_SHIFT,
+                                (loff_t)(last - first) << PAGE_SHIFT, 0);
+        asgn1_punch_pages_locked(dev, first, last - 1);
+    }
+}
 
 /*
- * asgn1_write - Write data to the ramdisk.
- * 1. Dynamic allocate new pages if the write exceeds capacity.
- * 2. Copy data from user space into the correct page(s) at the offset.
- * 3. Update the file position and the total size of the ramdisk.
- */
-static ssize_t asgn1_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+* 1. Fill every hole in [offset, end) with a zeroed page, existing data stays
+* 2. One ASGN1_PREALLOC_CHUNK at a time, held shared like a fault, so reads
+*    and writes elsewhere in the range aren't held off for the whole call
+* 3. Stops between chunks on a signal, the pages so far are kept and a
+*    restarted call only fills what's left
+* 4. Without KEEP_SIZE the size goes to end under the last chunk
+* 5. The pages filled in get ASGN1_MARK_INCOMPR, which the first write
+*    clears: the compression and dedup scans leave them alone until then,
+*    so the reserve survives until the writes it is for
+*/
+static long asgn1_prealloc(struct asgn1_dev *dev, loff_t offset, loff_t end, bool keep_size)
 {
-    ssize_t written_total = 0;
-    size_t pos;
+    pgoff_t index = offset >> PAGE_SHIFT, last = (end - 1) >> PAGE_SHIFT, chunk_last;
+    unsigned long *holes, i, nr;
+    struct asgn1_range r;
+    void *entry;
     int rc = 0;
 
-    if (!count)
-        return 0;
+    holes = bitmap_zalloc(ASGN1_PREALLOC_CHUNK, GFP_KERNEL);
+    if (!holes)
+        return -ENOMEM;
 
-    mutex_lock(&gdev.lock);
+    for (; index <= last; index = chunk_last + 1) {
+        if (signal_pending(current)) {
+            rc = -ERESTARTSYS;
+            break;
+        }
 
-    pos = (size_t)*ppos;
+        chunk_last = min_t(pgoff_t, last,
+                           ALIGN_DOWN(index, ASGN1_PREALLOC_CHUNK) + ASGN1_PREALLOC_CHUNK - 1);
+        nr = chunk_last - index + 1;
+        asgn1_range_lock(dev, &r, index, chunk_last, false);
 
-    // Ensure pages exist up to the end of this write
-    {
-        size_t end_pos = pos + count;
-        size_t needed_pages = (end_pos + PAGE_SIZE - 1) >> PAGE_SHIFT;
-	// Dynamically expand the ramdisk if necessary
-	// Avoid incomplete writes
-        rc = asgn1_ensure_pages_locked(&gdev, needed_pages);
-        if (rc) {
-            mutex_unlock(&gdev.lock);
-            return rc;
-        }
+        // Only the holes become reserve, pages already there keep their marks
+        bitmap_fill(holes, nr);
+        xa_for_each_range(dev->pages, i, entry, index, chunk_last)
+            clear_bit(i - index, holes);
+        rc = asgn1_ensure_range_locked(dev, index, chunk_last);
+        for_each_set_bit(i, holes, nr)
+            xa_set_mark(dev->pages, index + i, ASGN1_MARK_INCOMPR);
+
+        if (!rc && chunk_last == last && !keep_size)
+            asgn1_extend_size(dev, end);
+        asgn1_range_unlock(dev, &r);
+        if (rc)
+            break;
+        cond_resched();
     }
+    bitmap_free(holes);
+    return rc;
+}
 
-    // Perform paged write
-    {
-        size_t remaining = count;
-
-        while (remaining) {
-            size_t page_index = pos >> PAGE_SHIFT;
-            size_t page_off   = pos & (PAGE_SIZE - 1);
-            size_t chunk      = min(remaining, PAGE_SIZE - page_off);
-            struct page_node *pn = asgn1_get_nth_page_locked(&gdev, page_index);
-            void *kaddr;
-
-            if (!pn || !pn->page) {
-                rc = -EIO;
-                break;
-            }
+/*
+ * asgn1_fallocate - ASGN1_IOCTL_FALLOCATE, preallocation, hole punching
+ * and zeroing.
+ * 1. Mode 0 or KEEP_SIZE preallocates, see asgn1_prealloc().
+ * 2. Otherwise zero the range, see asgn1_zero_range_locked().
+ * 3. ZERO_RANGE without KEEP_SIZE also extends the size to offset + len.
+ * The whole byte range is held exclusively throughout zeroing.
+ */
+static long asgn1_fallocate(struct file *filp, struct asgn1_dev *dev,
+                            const struct asgn1_falloc *fa)
+{
+    loff_t offset = fa->offset, end;
+    struct asgn1_range r;
 
-            kaddr = asgn1_kmap_local(pn->page);
+    if (fa->mode != 0 && fa->mode != FALLOC_FL_KEEP_SIZE &&
+        fa->mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE) &&
+        fa->mode != FALLOC_FL_ZERO_RANGE &&
+        fa->mode != (FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (fa->pad || offset < 0 || !fa->len || fa->len > MAX_LFS_FILESIZE - offset)
+        return -EINVAL;
 
-	        // Copy the chunk from the user space to kern
-            if (copy_from_user((char *)kaddr + page_off, buf + written_total, chunk)) {
-                kunmap_local(kaddr);
-                rc = -EFAULT;
-                break;
-            }
-            asgn1_kunmap_local(kaddr);
+    end = offset + fa->len;
+    if (!(fa->mode & ~FALLOC_FL_KEEP_SIZE))
+        return asgn1_prealloc(dev, offset, end, fa->mode & FALLOC_FL_KEEP_SIZE);
 
-            pos += chunk;
-            written_total += chunk;
-            remaining -= chunk;
-        }
-    }
+    asgn1_range_lock(dev, &r, offset >> PAGE_SHIFT, (end - 1) >> PAGE_SHIFT, true);
+    asgn1_zero_range_locked(dev, offset, end);
 
-    if (written_total > 0) {
-        *ppos += written_total;
-        if ((size_t)*ppos > gdev.size_bytes)
-            gdev.size_bytes = (size_t)*ppos;
-    }
+    if (!(fa->mode & FALLOC_FL_KEEP_SIZE))
+        asgn1_extend_size(dev, end);
 
-    mutex_unlock(&gdev.lock);
-    return rc ? rc : written_total;
+    asgn1_range_unlock(dev, &r);
+    return 0;
 }
+
 /*
-* 1. Set the max users and open count
-* 2. filep is not used in this case
+* 1. Set the max users and open count of this instance
+* 2. Create/destroy instances, any node can be used as the control node
+* 3. Plain int fields, no lock needed
+* 4. fallocate (preallocation, hole punching) for the char device, see asgn1_ioctl.h
+* 5. Snapshot this instance into a new one
+* 6. Tail-follow mode of this open file only
 */
 static long asgn1_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    struct asgn1_file *af = filp->private_data;
+    struct asgn1_dev *dev = af->dev;
+    struct asgn1_falloc fa = {};
+    struct asgn1_open_stats os;
     long rc = 0;
     int val = 0;
 
-    mutex_lock(&gdev.lock);
-
     switch (cmd) {
     case ASGN1_IOCTL_SET_MAX_USERS:
         if (copy_from_user(&val, (void __user *)arg, sizeof(val))) {
@@ -404,31 +4574,140 @@ static long asgn1_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned l
             break;
         }
         // If decreasing below current open_count, we still allow current holders;
-        // New opens will be denied until open_count < max_users.
-        gdev.max_users = val;
+        // New opens queue (or fail with O_NONBLOCK) until open_count < max_users.
+        mutex_lock(&dev->lock);
+        WRITE_ONCE(dev->max_users, val);
+        asgn1_admit_locked(dev);
+        mutex_unlock(&dev->lock);
         break;
 
     case ASGN1_IOCTL_GET_MAX_USERS:
-        val = gdev.max_users;
+        val = READ_ONCE(dev->max_users);
         if (copy_to_user((void __user *)arg, &val, sizeof(val)))
             rc = -EFAULT;
         break;
 
     case ASGN1_IOCTL_GET_OPEN_COUNT:
-        val = atomic_read(&gdev.open_count);
+        val = atomic_read(&dev->open_count);
+        if (copy_to_user((void __user *)arg, &val, sizeof(val)))
+            rc = -EFAULT;
+        break;
+
+    case ASGN1_IOCTL_GET_OPEN_STATS:
+        memset(&os, 0, sizeof(os));
+        mutex_lock(&dev->lock);
+        os.open_count = atomic_read(&dev->open_count);
+        os.max_users = dev->max_users;
+        os.queued = dev->open_queued;
+        os.queued_max = dev->open_queued_max;
+        os.waited = dev->open_waited;
+        os.wait_ns = dev->open_wait_ns;
+        os.wait_max_ns = dev->open_wait_max_ns;
+        os.rejected = dev->open_rejected;
+        mutex_unlock(&dev->lock);
+        if (copy_to_user((void __user *)arg, &os, sizeof(os)))
+            rc = -EFAULT;
+        break;
+
+    case ASGN1_IOCTL_CREATE_DEV:
+        if (!capable(CAP_SYS_ADMIN)) {
+            rc = -EPERM;
+            break;
+        }
+        if (copy_from_user(&val, (void __user *)arg, sizeof(val))) {
+            rc = -EFAULT;
+            break;
+        }
+        val = asgn1_dev_create(val, NULL);
+        if (val < 0) {
+            rc = val;
+            break;
+        }
+        if (copy_to_user((void __user *)arg, &val, sizeof(val)))
+            rc = -EFAULT;
+        break;
+
+    case ASGN1_IOCTL_DESTROY_DEV:
+        if (!capable(CAP_SYS_ADMIN)) {
+            rc = -EPERM;
+            break;
+        }
+        if (copy_from_user(&val, (void __user *)arg, sizeof(val))) {
+            rc = -EFAULT;
+            break;
+        }
+        rc = asgn1_dev_destroy(val, false);
+        break;
+
+    case ASGN1_IOCTL_SNAPSHOT:
+        if (!capable(CAP_SYS_ADMIN)) {
+            rc = -EPERM;
+            break;
+        }
+        if (copy_from_user(&val, (void __user *)arg, sizeof(val))) {
+            rc = -EFAULT;
+            break;
+        }
+        val = asgn1_dev_create(val, dev);
+        if (val < 0) {
+            rc = val;
+            break;
+        }
+        if (copy_to_user((void __user *)arg, &val, sizeof(val)))
+            rc = -EFAULT;
+        break;
+
+    case ASGN1_IOCTL_SET_FOLLOW:
+        if (copy_from_user(&val, (void __user *)arg, sizeof(val))) {
+            rc = -EFAULT;
+            break;
+        }
+        WRITE_ONCE(af->follow, !!val);
+        // Readers of this file already waiting get EOF right away
+        if (!val)
+            wake_up_interruptible_all(&dev->data_wq);
+        break;
+
+    case ASGN1_IOCTL_GET_FOLLOW:
+        val = READ_ONCE(af->follow);
         if (copy_to_user((void __user *)arg, &val, sizeof(val)))
             rc = -EFAULT;
         break;
 
+    case ASGN1_IOCTL_FALLOCATE:
+        if (copy_from_user(&fa, (void __user *)arg, sizeof(fa))) {
+            rc = -EFAULT;
+            break;
+        }
+        rc = asgn1_fallocate(filp, dev, &fa);
+        break;
+
     default:
         rc = -ENOTTY;
         break;
     }
 
-    mutex_unlock(&gdev.lock);
+    trace_asgn1_ioctl(dev->minor, cmd, cmd == ASGN1_IOCTL_FALLOCATE ? fa.mode : val,
+                      fa.offset, fa.len, rc);
     return rc;
 }
 
+/*
+* 1. Readable while f_pos is before EOF, always without follow mode
+* 2. Pollers wait on data_wq, woken by asgn1_extend_size()
+*/
+static __poll_t asgn1_poll(struct file *filp, poll_table *wait)
+{
+    struct asgn1_dev *dev = asgn1_file_dev(filp);
+    struct asgn1_file *af = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->data_wq, wait);
+    if (!READ_ONCE(af->follow) || READ_ONCE(filp->f_pos) < (loff_t)asgn1_size(dev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
 /*
 1. file_operations is like an interface
 2. Kernel intercepts all the calls b/w user <-> driver
@@ -437,58 +4716,371 @@ static const struct file_operations asgn1_fops = {
     .owner          = THIS_MODULE,
     .open           = asgn1_open,
     .release        = asgn1_release,
-    .read           = asgn1_read,
-    .write          = asgn1_write,
+    .read_iter      = asgn1_read_iter,
+    .write_iter     = asgn1_write_iter,
+    .splice_read    = asgn1_splice_read,
+    .splice_write   = iter_file_splice_write,   // bvec write_iter, one copy
     .llseek         = asgn1_llseek,
     .unlocked_ioctl = asgn1_unlocked_ioctl,
     .mmap           = asgn1_mmap,
+    .fadvise        = asgn1_fadvise,
+    .poll           = asgn1_poll,
+#ifdef ASGN1_PMD_MAP
+    .get_unmapped_area = thp_get_unmapped_area,   // 2 MiB aligned mappings
+#endif
+};
+
+/* ---------- block device frontend ---------- */
+
+/*
+ * Serve one read or write request straight from the page store.
+ * 1. The pages it covers are held in the range lock, exclusively for
+ *    writes, so it is coherent with read(), write() and mmap.
+ * 2. Writes fill holes first and unshare deduplicated pages, then each
+ *    bio segment is copied once, to or from the store page.
+ * 3. Holes read as zeros. Writes extend the char device's size, so the
+ *    data is visible through /dev/asgn1 as well.
+ * 4. Out of memory fails the request with BLK_STS_IOERR. It has been
+ *    started already, so BLK_STS_RESOURCE would not requeue it.
+ */
+static blk_status_t asgn1_blk_rw(struct asgn1_dev *dev, struct request *rq)
+{
+    bool write = op_is_write(req_op(rq));
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    unsigned int len = blk_rq_bytes(rq);
+    blk_status_t err = BLK_STS_OK;
+    struct req_iterator iter;
+    struct asgn1_range r;
+    struct bio_vec bv;
+
+    if (!len)
+        return BLK_STS_OK;
+
+    asgn1_range_lock(dev, &r, pos >> PAGE_SHIFT, (pos + len - 1) >> PAGE_SHIFT, write);
+    if (write && asgn1_ensure_range_locked(dev, pos >> PAGE_SHIFT,
+                                           (pos + len - 1) >> PAGE_SHIFT)) {
+        err = BLK_STS_IOERR;
+        goto out;
+    }
+
+    rq_for_each_segment(bv, rq, iter) {
+        unsigned int done = 0;
+
+        while (done < bv.bv_len) {
+            pgoff_t index = pos >> PAGE_SHIFT;
+            unsigned int off = pos & ~PAGE_MASK;
+            unsigned int n = min_t(unsigned int, bv.bv_len - done, PAGE_SIZE - off);
+            struct page *page;
+
+            if (write) {
+                page = asgn1_get_nth_page_write_locked(dev, index);
+                if (!page) {
+                    err = BLK_STS_IOERR;
+                    goto out;
+                }
+                memcpy_page(page, off, bv.bv_page, bv.bv_offset + done, n);
+                asgn1_mark_dirty(dev, index);
+            } else {
+                page = asgn1_get_nth_page_locked(dev, index);
+                if (page)
+                    memcpy_page(bv.bv_page, bv.bv_offset + done, page, off, n);
+                else
+                    memzero_page(bv.bv_page, bv.bv_offset + done, n);
+            }
+            pos += n;
+            done += n;
+        }
+    }
+    if (write)
+        asgn1_extend_size(dev, pos);
+
+out:
+    asgn1_range_unlock(dev, &r);
+    return err;
+}
+
+// Discard and write-zeroes: holes are zeros, so both punch
+static blk_status_t asgn1_blk_discard(struct asgn1_dev *dev, struct request *rq)
+{
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    unsigned int len = blk_rq_bytes(rq);
+    struct asgn1_range r;
+
+    if (!len)
+        return BLK_STS_OK;
+
+    asgn1_range_lock(dev, &r, pos >> PAGE_SHIFT, (pos + len - 1) >> PAGE_SHIFT, true);
+    asgn1_zero_range_locked(dev, pos, pos + len);
+    asgn1_range_unlock(dev, &r);
+    return BLK_STS_OK;
+}
+
+/*
+ * asgn1_queue_rq - blk-mq entry, one per hardware queue (CPU).
+ * Requests complete inline. The range lock, grow_lock and page
+ * allocation may sleep, so the tag set is BLK_MQ_F_BLOCKING.
+ */
+static blk_status_t asgn1_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                   const struct blk_mq_queue_data *bd)
+{
+    struct asgn1_dev *dev = hctx->queue->queuedata;
+    struct request *rq = bd->rq;
+    u64 t0 = ktime_get_ns();
+    blk_status_t err;
+
+    blk_mq_start_request(rq);
+
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        err = asgn1_blk_rw(dev, rq);
+        asgn1_account(dev, req_op(rq) == REQ_OP_WRITE ? ASGN1_OP_BLK_WRITE : ASGN1_OP_BLK_READ,
+                      t0, blk_rq_bytes(rq));
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        err = asgn1_blk_discard(dev, rq);
+        break;
+    case REQ_OP_FLUSH:
+        err = BLK_STS_OK;   // nothing volatile below us
+        break;
+    default:
+        err = BLK_STS_NOTSUPP;
+        break;
+    }
+
+    blk_mq_end_request(rq, err);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops asgn1_mq_ops = {
+    .queue_rq = asgn1_queue_rq,
+};
+
+/*
+ * Block device opens of an instance being destroyed fail. Called under
+ * disk->open_mutex, which asgn1_dev_destroy() takes after setting dead.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int asgn1_blk_open(struct gendisk *disk, blk_mode_t mode)
+{
+    struct asgn1_dev *dev = disk->private_data;
+#else
+static int asgn1_blk_open(struct block_device *bdev, fmode_t mode)
+{
+    struct asgn1_dev *dev = bdev->bd_disk->private_data;
+#endif
+
+    return READ_ONCE(dev->dead) ? -ENXIO : 0;
+}
+
+static const struct block_device_operations asgn1_bdops = {
+    .owner = THIS_MODULE,
+    .open  = asgn1_blk_open,
 };
 
+/*
+ * Add /dev/asgn1b<minor> over dev's page store.
+ * 1. One hardware queue per possible CPU, so submitters never share one.
+ * 2. blk_mb MiB of capacity. The store is sparse, so nothing is
+ *    allocated until it is written.
+ * 3. Pages are the physical block size, discards punch holes.
+ */
+static int asgn1_blk_add(struct asgn1_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    struct queue_limits lim = {
+        .physical_block_size        = PAGE_SIZE,
+        .io_min                     = PAGE_SIZE,
+        .max_hw_discard_sectors     = UINT_MAX >> SECTOR_SHIFT,
+        .max_write_zeroes_sectors   = UINT_MAX >> SECTOR_SHIFT,
+        .discard_granularity        = PAGE_SIZE,
+    };
+#endif
+    struct gendisk *disk;
+    int rc;
+
+    if (!blk_mb)
+        return 0;
+
+    dev->tag_set.ops = &asgn1_mq_ops;
+    dev->tag_set.nr_hw_queues = nr_cpu_ids;
+    dev->tag_set.queue_depth = ASGN1_BLK_QUEUE_DEPTH;
+    dev->tag_set.numa_node = NUMA_NO_NODE;
+    dev->tag_set.flags = BLK_MQ_F_BLOCKING;
+    dev->tag_set.driver_data = dev;
+    rc = blk_mq_alloc_tag_set(&dev->tag_set);
+    if (rc)
+        return rc;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
+#else
+    disk = blk_mq_alloc_disk(&dev->tag_set, dev);
+#endif
+    if (IS_ERR(disk)) {
+        rc = PTR_ERR(disk);
+        goto err_tags;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+    blk_queue_physical_block_size(disk->queue, PAGE_SIZE);
+    blk_queue_io_min(disk->queue, PAGE_SIZE);
+    blk_queue_max_discard_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+    blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+    disk->queue->limits.discard_granularity = PAGE_SIZE;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+#endif
+
+    disk->major = asgn1_blk_major;
+    disk->first_minor = dev->minor * ASGN1_BLK_MINORS;
+    disk->minors = ASGN1_BLK_MINORS;
+    disk->fops = &asgn1_bdops;
+    disk->private_data = dev;
+    snprintf(disk->disk_name, DISK_NAME_LEN, "%sb%d", asgn1_name, dev->minor);
+    set_capacity(disk, blk_mb << (20 - SECTOR_SHIFT));
+
+    rc = add_disk(disk);
+    if (rc)
+        goto err_disk;
+    dev->disk = disk;
+    return 0;
+
+err_disk:
+    put_disk(disk);
+err_tags:
+    blk_mq_free_tag_set(&dev->tag_set);
+    return rc;
+}
+
+// Caller made sure nothing has the block device open
+static void asgn1_blk_del(struct asgn1_dev *dev)
+{
+    if (!dev->disk)
+        return;
+    del_gendisk(dev->disk);
+    put_disk(dev->disk);
+    blk_mq_free_tag_set(&dev->tag_set);
+    dev->disk = NULL;
+}
+
+// World read/write nodes (requirement 13), no chmod needed after load
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static char *asgn1_devnode(const struct device *dev, umode_t *mode)
+#else
+static char *asgn1_devnode(struct device *dev, umode_t *mode)
+#endif
+{
+    if (mode)
+        *mode = 0666;
+    return NULL;
+}
+
 /*
  * asgn1_init - Module initialization function
- * 1. Initializes the global device (gdev).
- * 2. Registers the character device and gets major number.
+ * 1. Reserves ASGN1_MAX_DEVS minors and gets major number, plus a block
+ *    major for the asgn1b disks.
+ * 2. Creates the udev class and the first ndevices instances. At least
+ *    one, creating more goes through an open node.
  */
 static int __init asgn1_init(void)
 {
-    int rc;
+    int rc, i;
 
-    INIT_LIST_HEAD(&gdev.pages);
-    mutex_init(&gdev.lock);
-    gdev.size_bytes = 0;
-    gdev.max_users = 0;   // 0 == unlimited
-    atomic_set(&gdev.open_count, 0);
+    if (ndevices < 1 || ndevices > ASGN1_MAX_DEVS) {
+        pr_err(DRV_NAME ": ndevices must be 1..%d\n", ASGN1_MAX_DEVS);
+        return -EINVAL;
+    }
 
-    rc = register_chrdev(0, asgn1_name, &asgn1_fops);
+    rc = alloc_chrdev_region(&asgn1_devt, 0, ASGN1_MAX_DEVS, asgn1_name);
     if (rc < 0) {
-        pr_err(DRV_NAME ": register_chrdev failed: %d\n", rc);
+        pr_err(DRV_NAME ": alloc_chrdev_region failed: %d\n", rc);
         return rc;
     }
-    asgn1_major = rc;
+    asgn1_major = MAJOR(asgn1_devt);
+
+    asgn1_blk_major = register_blkdev(0, "asgn1b");
+    if (asgn1_blk_major < 0) {
+        rc = asgn1_blk_major;
+        pr_err(DRV_NAME ": register_blkdev failed: %d\n", rc);
+        goto err_region;
+    }
+
+    asgn1_reclaim_wq = alloc_workqueue("asgn1_reclaim", WQ_UNBOUND, 0);
+    if (!asgn1_reclaim_wq) {
+        rc = -ENOMEM;
+        goto err_blk;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    asgn1_class = class_create(asgn1_name);
+#else
+    asgn1_class = class_create(THIS_MODULE, asgn1_name);
+#endif
+    if (IS_ERR(asgn1_class)) {
+        rc = PTR_ERR(asgn1_class);
+        pr_err(DRV_NAME ": class_create failed: %d\n", rc);
+        goto err_wq;
+    }
+    asgn1_class->devnode = asgn1_devnode;
+    asgn1_debugfs = debugfs_create_dir(DRV_NAME, NULL);
+
+    for (i = 0; i < ndevices; i++) {
+        rc = asgn1_dev_create(i, NULL);
+        if (rc < 0) {
+            pr_err(DRV_NAME ": creating instance %d failed: %d\n", i, rc);
+            goto err_devs;
+        }
+    }
 
-    pr_info(DRV_NAME ": loaded. Major=%d. Create node with: mknod /dev/%s c %d 0\n",
-            asgn1_major, asgn1_name, asgn1_major);
+    pr_info(DRV_NAME ": loaded. Major=%d, %d instance(s)\n", asgn1_major, ndevices);
     pr_info(DRV_NAME ": " DRV_DESC "\n");
     return 0;
+
+err_devs:
+    while (--i >= 0)
+        asgn1_dev_destroy(i, true);
+    debugfs_remove(asgn1_debugfs);
+    class_destroy(asgn1_class);
+err_wq:
+    destroy_workqueue(asgn1_reclaim_wq);
+err_blk:
+    unregister_blkdev(asgn1_blk_major, "asgn1b");
+err_region:
+    unregister_chrdev_region(asgn1_devt, ASGN1_MAX_DEVS);
+    return rc;
 }
 
 /*
  * asgn1_exit - Module cleanup function.
- * 1. Free all allocated pages to prevent memory leaks.
- * 2. Unregister the character device from the kernel.
+ * 1. Destroy every instance, freeing all allocated pages. With backing_dir
+ *    each one is checkpointed first, the next load restores it.
+ * 2. Unregister the class, the block major and the character device region.
  */
 static void __exit asgn1_exit(void)
 {
-    mutex_lock(&gdev.lock);
-    asgn1_free_all_pages_locked(&gdev);
-    mutex_unlock(&gdev.lock);
+    int i;
 
-    if (asgn1_major > 0)
-        unregister_chrdev(asgn1_major, asgn1_name);
+    // Nothing can be open here, the module refcount would pin us
+    for (i = 0; i < ASGN1_MAX_DEVS; i++)
+        asgn1_dev_destroy(i, true);
+
+    // Drains pending reclaim, which drops the last instance refs
+    destroy_workqueue(asgn1_reclaim_wq);
+    debugfs_remove(asgn1_debugfs);
+    class_destroy(asgn1_class);
+    unregister_blkdev(asgn1_blk_major, "asgn1b");
+    unregister_chrdev_region(asgn1_devt, ASGN1_MAX_DEVS);
 
     pr_info(DRV_NAME ": unloaded\n");
 }
 
+// The suite needs the static store functions, so it is part of this file
+#if defined(ASGN1_KUNIT) && IS_ENABLED(CONFIG_KUNIT)
+#include "asgn1_kunit.c"
+#endif
+
 module_init(asgn1_init);
 module_exit(asgn1_exit);
 
@@ -0,0 +1,190 @@
+/*
+ * asgn1_trace.h - Tracepoints of the asgn1 ramdisk.
+ *
+ * Only included by asgn1_skel.c, which defines CREATE_TRACE_POINTS.
+ * The events show up under /sys/kernel/tracing/events/asgn1/ and in
+ * perf and bpftrace as asgn1:<event>. Disabled, each one is a static
+ * branch that is never taken.
+ *
+ * wait_ns is the time spent sleeping for the range lock (grow_lock for
+ * asgn1_alloc), 0 when it was free.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM asgn1
+
+#if !defined(ASGN1_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define ASGN1_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// read() and write(), one event per call once the range lock was taken
+DECLARE_EVENT_CLASS(asgn1_rw,
+    TP_PROTO(int minor, loff_t pos, size_t count, u64 wait_ns, ssize_t ret),
+    TP_ARGS(minor, pos, count, wait_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(u64, wait_ns)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->wait_ns = wait_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%d pos=%lld count=%zu index=%llu wait_ns=%llu ret=%zd",
+              __entry->minor, __entry->pos, __entry->count,
+              (unsigned long long)(__entry->pos >> PAGE_SHIFT),
+              __entry->wait_ns, __entry->ret)
+);
+
+DEFINE_EVENT(asgn1_rw, asgn1_read,
+    TP_PROTO(int minor, loff_t pos, size_t count, u64 wait_ns, ssize_t ret),
+    TP_ARGS(minor, pos, count, wait_ns, ret)
+);
+
+DEFINE_EVENT(asgn1_rw, asgn1_write,
+    TP_PROTO(int minor, loff_t pos, size_t count, u64 wait_ns, ssize_t ret),
+    TP_ARGS(minor, pos, count, wait_ns, ret)
+);
+
+// A PTE fault: the faulting index, the fault-around window and the result
+TRACE_EVENT(asgn1_fault,
+    TP_PROTO(int minor, pgoff_t index, pgoff_t first, pgoff_t last, bool write,
+             u64 wait_ns, unsigned int ret),
+    TP_ARGS(minor, index, first, last, write, wait_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(pgoff_t, index)
+        __field(pgoff_t, first)
+        __field(pgoff_t, last)
+        __field(bool, write)
+        __field(u64, wait_ns)
+        __field(unsigned int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->index = index;
+        __entry->first = first;
+        __entry->last = last;
+        __entry->write = write;
+        __entry->wait_ns = wait_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%d index=%lu around=%lu-%lu write=%d wait_ns=%llu ret=%#x",
+              __entry->minor, __entry->index, __entry->first, __entry->last,
+              __entry->write, __entry->wait_ns, __entry->ret)
+);
+
+// Holes in [first, last] filled by asgn1_ensure_range_locked()
+TRACE_EVENT(asgn1_alloc,
+    TP_PROTO(int minor, pgoff_t first, pgoff_t last, unsigned long allocated,
+             u64 wait_ns, int ret),
+    TP_ARGS(minor, first, last, allocated, wait_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(pgoff_t, first)
+        __field(pgoff_t, last)
+        __field(unsigned long, allocated)
+        __field(u64, wait_ns)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->first = first;
+        __entry->last = last;
+        __entry->allocated = allocated;
+        __entry->wait_ns = wait_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%d index=%lu-%lu allocated=%lu wait_ns=%llu ret=%d",
+              __entry->minor, __entry->first, __entry->last, __entry->allocated,
+              __entry->wait_ns, __entry->ret)
+);
+
+/*
+ * Store teardown. asgn1_free_all: pages freed inline, workers is 0.
+ * asgn1_truncate: pages handed to that many reclaim workers. A truncate
+ * small enough to free inline only shows as asgn1_free_all.
+ */
+DECLARE_EVENT_CLASS(asgn1_store,
+    TP_PROTO(int minor, unsigned long nr_pages, unsigned int workers),
+    TP_ARGS(minor, nr_pages, workers),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, nr_pages)
+        __field(unsigned int, workers)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->nr_pages = nr_pages;
+        __entry->workers = workers;
+    ),
+
+    TP_printk("minor=%d nr_pages=%lu workers=%u",
+              __entry->minor, __entry->nr_pages, __entry->workers)
+);
+
+DEFINE_EVENT(asgn1_store, asgn1_free_all,
+    TP_PROTO(int minor, unsigned long nr_pages, unsigned int workers),
+    TP_ARGS(minor, nr_pages, workers)
+);
+
+DEFINE_EVENT(asgn1_store, asgn1_truncate,
+    TP_PROTO(int minor, unsigned long nr_pages, unsigned int workers),
+    TP_ARGS(minor, nr_pages, workers)
+);
+
+/*
+ * Every ioctl on an instance node. val is the int argument (in or out),
+ * for ASGN1_IOCTL_FALLOCATE the mode, with offset and len of the range.
+ */
+TRACE_EVENT(asgn1_ioctl,
+    TP_PROTO(int minor, unsigned int cmd, int val, u64 offset, u64 len, long ret),
+    TP_ARGS(minor, cmd, val, offset, len, ret),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, cmd)
+        __field(int, val)
+        __field(u64, offset)
+        __field(u64, len)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->val = val;
+        __entry->offset = offset;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%d cmd=%#x val=%d offset=%llu len=%llu ret=%ld",
+              __entry->minor, __entry->cmd, __entry->val, __entry->offset,
+              __entry->len, __entry->ret)
+);
+
+#endif /* ASGN1_TRACE_H */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE asgn1_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,793 @@
+/*
+ * io_replay - capture the I/O a workload sends to /dev/asgn1, replay it later
+ *
+ *   io_replay record [-f device] [-o trace] [-d seconds] [-- command ...]
+ *   io_replay replay [-f device] [-x speed] [-k] trace
+ *
+ * record enables the driver's tracepoints (asgn1_read, asgn1_write,
+ * asgn1_fault and asgn1_ioctl, see asgn1_trace.h) for the device's minor
+ * and turns trace_pipe into a binary trace: a struct trc_hdr, then one
+ * 40 byte struct trc_rec per operation. It runs the command and stops
+ * when it exits, or stops after -d seconds or on Ctrl-C. Any process
+ * using the device is captured, not only the command. Needs root and
+ * tracefs.
+ *
+ * replay lays down an image of the size the device had when the capture
+ * started (-k keeps the current contents instead) and starts one thread
+ * per traced thread, each with its own fd. Every thread issues its own
+ * operations in order at their original time offsets, divided by -x
+ * (default 1, 0 replays back to back). Reads and writes become
+ * pread()/pwrite() at the traced offset. Faults become a load or store
+ * to that page of a shared mapping. Read-only ioctls and FALLOCATE are
+ * reissued. SET_MAX_USERS, CREATE_DEV, DESTROY_DEV, SNAPSHOT and
+ * SET_FOLLOW would change what is being measured, so they are skipped
+ * and counted.
+ *
+ * Prints one JSON object with the latency distribution of each operation
+ * type, in the same form as io_bench, and how far the replay fell
+ * behind the traced timing.
+ *
+ * Only PTE faults are traced. A page the workload touched again after
+ * it was mapped causes no fault and is not in the trace.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "asgn1_ioctl.h"
+
+#define TRC_MAGIC       "ASGN1TRC"
+#define TRC_VERSION     1
+#define MAX_THREADS     65535
+
+// VM_FAULT_OOM | SIGBUS | HWPOISON | HWPOISON_LARGE | SIGSEGV, a failed fault
+#define TRC_FAULT_ERR   0x0073
+
+#define SUB_BITS        5
+#define SUB             (1U << SUB_BITS)
+#define NR_BUCKETS      ((64 - SUB_BITS + 1) * SUB)
+
+enum { OP_READ, OP_WRITE, OP_FAULT, OP_IOCTL, NR_OPS };
+
+static const char * const op_names[] = { "read", "write", "fault", "ioctl" };
+
+struct trc_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t nr_threads;
+    uint64_t nr_recs;
+    uint64_t dev_size;      // device size when the capture started
+    uint32_t page_size;
+    uint32_t pad;
+};
+
+struct trc_rec {
+    uint64_t ts_ns;         // since the first record
+    uint64_t pos;           // read/write: byte offset, fault: page index,
+                            // ioctl: fallocate offset
+    uint64_t len;           // read/write: bytes asked for, ioctl: fallocate length
+    uint32_t cmd;           // ioctl: command, fault: 1 for a write fault
+    int32_t val;            // ioctl: int argument or fallocate mode
+    int32_t ret;            // read/write/ioctl: result, fault: VM_FAULT_* bits
+    uint16_t thread;        // traced thread, numbered by first appearance
+    uint8_t op;
+    uint8_t pad;
+};
+
+struct lat {
+    unsigned long long ops;
+    unsigned long long bytes;
+    unsigned long long errors;
+    unsigned long long sum_ns;
+    unsigned long long min_ns, max_ns;
+    unsigned long long hist[NR_BUCKETS];
+};
+
+struct replayer {
+    pthread_t tid;
+    struct trc_rec **recs;
+    size_t nr;
+    struct lat lat[NR_OPS];
+    unsigned long long skipped;
+    uint64_t lag_max_ns;
+    unsigned long long lag_sum_ns;
+};
+
+static const char *filename = "/dev/asgn1";
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "%s failed:  %s\n", what, strerror(errno));
+    exit(1);
+}
+
+/* ---------- latency histograms, as in io_bench ---------- */
+
+// Values below SUB get a bucket each, above that SUB buckets per power of two
+static unsigned int lat_bucket(uint64_t ns)
+{
+    unsigned int msb;
+
+    if (ns < SUB)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - SUB_BITS + 1) * SUB + ((ns >> (msb - SUB_BITS)) & (SUB - 1));
+}
+
+// Largest value that lands in bucket b
+static uint64_t bucket_upper(unsigned int b)
+{
+    unsigned int group = b / SUB;
+
+    if (!group)
+        return b;
+    return (((uint64_t)(SUB + b % SUB) + 1) << (group - 1)) - 1;
+}
+
+static void lat_add(struct lat *l, uint64_t ns)
+{
+    if (!l->ops || ns < l->min_ns)
+        l->min_ns = ns;
+    if (ns > l->max_ns)
+        l->max_ns = ns;
+    l->ops++;
+    l->sum_ns += ns;
+    l->hist[lat_bucket(ns)]++;
+}
+
+static void lat_merge(struct lat *to, const struct lat *from)
+{
+    unsigned int b;
+
+    to->errors += from->errors;
+    if (!from->ops)
+        return;
+    if (!to->ops || from->min_ns < to->min_ns)
+        to->min_ns = from->min_ns;
+    if (from->max_ns > to->max_ns)
+        to->max_ns = from->max_ns;
+    to->ops += from->ops;
+    to->bytes += from->bytes;
+    to->sum_ns += from->sum_ns;
+    for (b = 0; b < NR_BUCKETS; b++)
+        to->hist[b] += from->hist[b];
+}
+
+// Smallest bucket bound that covers pct percent of the samples, capped at max
+static uint64_t lat_pct(const struct lat *l, double pct)
+{
+    unsigned long long want = (unsigned long long)(l->ops * pct / 100.0 + 0.5);
+    unsigned long long seen = 0;
+    unsigned int b;
+
+    if (!l->ops)
+        return 0;
+    if (!want)
+        want = 1;
+    for (b = 0; b < NR_BUCKETS; b++) {
+        seen += l->hist[b];
+        if (seen >= want)
+            return bucket_upper(b) < l->max_ns ? bucket_upper(b) : l->max_ns;
+    }
+    return l->max_ns;
+}
+
+/* ---------- record ---------- */
+
+static const char *tracefs;
+static pid_t thread_tids[MAX_THREADS];
+static unsigned int nr_threads;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void tracefs_write(const char *file, const char *val)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", tracefs, file);
+    if ((fd = open(path, O_WRONLY | O_TRUNC)) < 0 ||
+        write(fd, val, strlen(val)) < 0) {
+        fprintf(stderr, "writing %s failed:  %s\n", path, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+}
+
+static void set_events(const char *on)
+{
+    tracefs_write("events/asgn1/asgn1_read/enable", on);
+    tracefs_write("events/asgn1/asgn1_write/enable", on);
+    tracefs_write("events/asgn1/asgn1_fault/enable", on);
+    tracefs_write("events/asgn1/asgn1_ioctl/enable", on);
+}
+
+static int thread_index(pid_t tid)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_threads; i++)
+        if (thread_tids[i] == tid)
+            return i;
+    if (nr_threads == MAX_THREADS)
+        return -1;
+    thread_tids[nr_threads] = tid;
+    return nr_threads++;
+}
+
+/*
+ * One trace_pipe line, e.g.
+ *   mmap_test-1234  [003] ..... 5120.123456: asgn1_read: minor=0 pos=0 ...
+ * The thread id ends the task field before " [", the timestamp (us
+ * resolution) comes right before the event name.
+ */
+static int parse_line(char *line, struct trc_rec *rec, uint64_t *ts_ns)
+{
+    char *ev = strstr(line, ": asgn1_"), *p;
+    long long pos, ret;
+    unsigned long long a, b, c;
+    unsigned int cmd;
+    int minor, val, tidx;
+    pid_t tid;
+
+    if (!ev || !(p = strstr(line, " [")) || p > ev)
+        return 0;
+    while (p > line && p[-1] == ' ')
+        p--;
+    while (p > line && p[-1] != '-')
+        p--;
+    tid = atoi(p);
+    for (p = ev; p > line && p[-1] != ' '; p--)
+        ;
+    *ts_ns = (uint64_t)(strtod(p, NULL) * 1e9 + 0.5);
+
+    memset(rec, 0, sizeof(*rec));
+    ev += 2;
+    if (sscanf(ev, "asgn1_read: minor=%d pos=%lld count=%llu index=%llu wait_ns=%llu ret=%lld",
+               &minor, &pos, &a, &b, &c, &ret) == 6) {
+        rec->op = OP_READ;
+        rec->pos = pos;
+        rec->len = a;
+    } else if (sscanf(ev, "asgn1_write: minor=%d pos=%lld count=%llu index=%llu wait_ns=%llu ret=%lld",
+                      &minor, &pos, &a, &b, &c, &ret) == 6) {
+        rec->op = OP_WRITE;
+        rec->pos = pos;
+        rec->len = a;
+    } else if (sscanf(ev, "asgn1_fault: minor=%d index=%lld around=%llu-%llu write=%u wait_ns=%llu ret=%llx",
+                      &minor, &pos, &a, &b, &cmd, &c, (unsigned long long *)&ret) == 7) {
+        rec->op = OP_FAULT;
+        rec->pos = pos;
+        rec->cmd = cmd;
+    } else if (sscanf(ev, "asgn1_ioctl: minor=%d cmd=%x val=%d offset=%llu len=%llu ret=%lld",
+                      &minor, &cmd, &val, &a, &b, &ret) == 6) {
+        rec->op = OP_IOCTL;
+        rec->pos = a;
+        rec->len = b;
+        rec->cmd = cmd;
+        rec->val = val;
+    } else {
+        return 0;
+    }
+    rec->ret = ret;
+
+    if ((tidx = thread_index(tid)) < 0) {
+        fprintf(stderr, "more than %d threads traced\n", MAX_THREADS);
+        exit(1);
+    }
+    rec->thread = tidx;
+    return 1;
+}
+
+static int do_record(int argc, char **argv)
+{
+    struct trc_hdr hdr = { .magic = TRC_MAGIC, .version = TRC_VERSION };
+    const char *out = "asgn1.trc";
+    char buf[1 << 16], filter[64];
+    uint64_t ts0 = 0, ts, deadline = 0;
+    unsigned long long lost = 0;
+    size_t fill = 0;
+    struct trc_rec rec;
+    struct stat st;
+    off_t size;
+    pid_t child = 0;
+    int opt, pfd, fd, drain = 0;
+    FILE *f;
+
+    while ((opt = getopt(argc, argv, "f:o:d:")) != -1) {
+        switch (opt) {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'd':
+            deadline = now_ns() + strtoull(optarg, NULL, 0) * 1000000000ULL;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (stat(filename, &st) < 0)
+        die(filename);
+    if (!access("/sys/kernel/tracing/events/asgn1", F_OK))
+        tracefs = "/sys/kernel/tracing";
+    else if (!access("/sys/kernel/debug/tracing/events/asgn1", F_OK))
+        tracefs = "/sys/kernel/debug/tracing";
+    else {
+        fprintf(stderr, "no asgn1 events in tracefs, is the module loaded?\n");
+        return 1;
+    }
+
+    // The size replay has to start from, our own open is closed right away.
+    // A trace without it would replay onto an empty image, so fail instead.
+    if ((fd = open(filename, O_RDONLY | O_NONBLOCK)) < 0) {
+        if (errno == EBUSY)
+            fprintf(stderr, "%s is at max_users, raise it to record\n", filename);
+        die(filename);
+    }
+    if ((size = lseek(fd, 0, SEEK_END)) < 0)
+        die("lseek");
+    hdr.dev_size = size;
+    close(fd);
+    hdr.page_size = sysconf(_SC_PAGESIZE);
+
+    if (!(f = fopen(out, "w")))
+        die(out);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    snprintf(filter, sizeof(filter), "minor == %u", minor(st.st_rdev));
+    tracefs_write("events/asgn1/filter", filter);
+    tracefs_write("trace", "");
+    snprintf(buf, sizeof(buf), "%s/trace_pipe", tracefs);
+    if ((pfd = open(buf, O_RDONLY | O_NONBLOCK)) < 0)
+        die(buf);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    set_events("1");
+
+    if (optind < argc) {
+        if ((child = fork()) < 0)
+            die("fork");
+        if (!child) {
+            execvp(argv[optind], argv + optind);
+            die(argv[optind]);
+        }
+    }
+
+    /*
+     * 1. Read until the command exits, the time is up or a signal
+     * 2. Then switch the events off and drain what is still buffered
+     */
+    for (;;) {
+        struct pollfd p = { .fd = pfd, .events = POLLIN };
+        char *line, *nl;
+        ssize_t n;
+
+        if (!drain && (stop || (child && waitpid(child, NULL, WNOHANG) == child) ||
+                       (deadline && now_ns() >= deadline))) {
+            set_events("0");
+            drain = 1;
+        }
+        if (poll(&p, 1, 100) < 0 && errno != EINTR)
+            die("poll");
+        n = read(pfd, buf + fill, sizeof(buf) - fill - 1);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                die("read trace_pipe");
+            if (drain)
+                break;
+            continue;
+        }
+        if (!n && drain)
+            break;
+        fill += n;
+        buf[fill] = '\0';
+
+        for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+            *nl = '\0';
+            if (strstr(line, "LOST")) {
+                lost++;
+                continue;
+            }
+            if (!parse_line(line, &rec, &ts))
+                continue;
+            if (!hdr.nr_recs)
+                ts0 = ts;
+            rec.ts_ns = ts - ts0;
+            fwrite(&rec, sizeof(rec), 1, f);
+            hdr.nr_recs++;
+        }
+        fill -= line - buf;
+        memmove(buf, line, fill);
+    }
+
+    // A command still running after -d or Ctrl-C is left alone
+    tracefs_write("events/asgn1/filter", "0");
+    close(pfd);
+
+    hdr.nr_threads = nr_threads;
+    if (fseek(f, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fclose(f))
+        die(out);
+    fprintf(stderr, "%llu records from %u threads in %s\n",
+            (unsigned long long)hdr.nr_recs, nr_threads, out);
+    if (lost)
+        fprintf(stderr, "warning: the trace buffer overflowed %llu times, "
+                "raise %s/buffer_size_kb\n", lost, tracefs);
+    return 0;
+}
+
+/* ---------- replay ---------- */
+
+static struct trc_hdr hdr;
+static char *map;
+static size_t map_len;
+static size_t max_len;
+static double speed = 1.0;
+static uint64_t t_start;
+static pthread_barrier_t start_barrier;
+static volatile char fault_sink;
+
+static void fill_image(size_t size)
+{
+    size_t done = 0;
+    char *buf;
+    int fd;
+
+    // O_WRONLY truncates the device, giving every run the same image
+    if ((fd = open(filename, O_WRONLY)) < 0)
+        die(filename);
+    if (!(buf = malloc(1 << 20))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 0xa5, 1 << 20);
+
+    while (done < size) {
+        size_t len = size - done < (1 << 20) ? size - done : (1 << 20);
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("write");
+        }
+        done += n;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+// Records replay_fn() leaves out, see the top of the file
+static int skip_rec(const struct trc_rec *rec)
+{
+    if (rec->op == OP_FAULT)
+        return !map || rec->ret & TRC_FAULT_ERR;
+    if (rec->op != OP_IOCTL)
+        return 0;
+    switch (rec->cmd) {
+    case ASGN1_IOCTL_GET_MAX_USERS:
+    case ASGN1_IOCTL_GET_OPEN_COUNT:
+    case ASGN1_IOCTL_GET_OPEN_STATS:
+    case ASGN1_IOCTL_GET_FOLLOW:
+    case ASGN1_IOCTL_FALLOCATE:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+// Reissue one of the ioctls skip_rec() lets through, 1 on error
+static int replay_ioctl(int fd, const struct trc_rec *rec)
+{
+    struct asgn1_open_stats os;
+    struct asgn1_falloc fa;
+    int val;
+
+    switch (rec->cmd) {
+    case ASGN1_IOCTL_GET_OPEN_STATS:
+        return ioctl(fd, rec->cmd, &os) < 0;
+    case ASGN1_IOCTL_FALLOCATE:
+        memset(&fa, 0, sizeof(fa));
+        fa.mode = rec->val;
+        fa.offset = rec->pos;
+        fa.len = rec->len;
+        return ioctl(fd, rec->cmd, &fa) < 0;
+    default:
+        return ioctl(fd, rec->cmd, &val) < 0;
+    }
+}
+
+static void *replay_fn(void *arg)
+{
+    struct replayer *r = arg;
+    char *buf;
+    size_t i;
+    int fd;
+
+    if ((fd = open(filename, O_RDWR)) < 0)
+        die(filename);
+    if (!(buf = malloc(max_len ? max_len : 1))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 0x5a, max_len);
+
+    pthread_barrier_wait(&start_barrier);
+
+    for (i = 0; i < r->nr; i++) {
+        const struct trc_rec *rec = r->recs[i];
+        uint64_t t0, due;
+        ssize_t n = 0;
+        int err = 0;
+
+        // Faults that failed in the trace would only kill us with SIGBUS
+        if (skip_rec(rec)) {
+            r->skipped++;
+            continue;
+        }
+
+        if (speed > 0) {
+            struct timespec ts;
+
+            due = t_start + (uint64_t)(rec->ts_ns / speed);
+            ts.tv_sec = due / 1000000000ULL;
+            ts.tv_nsec = due % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+            t0 = now_ns();
+            if (t0 - due > r->lag_max_ns)
+                r->lag_max_ns = t0 - due;
+            r->lag_sum_ns += t0 - due;
+        } else {
+            t0 = now_ns();
+        }
+
+        switch (rec->op) {
+        case OP_READ:
+            n = pread(fd, buf, rec->len, rec->pos);
+            err = n < 0;
+            break;
+        case OP_WRITE:
+            n = pwrite(fd, buf, rec->len, rec->pos);
+            err = n < 0;
+            break;
+        case OP_FAULT:
+            if (rec->cmd)
+                map[rec->pos * hdr.page_size] = 0x5a;
+            else
+                fault_sink = map[rec->pos * hdr.page_size];
+            break;
+        case OP_IOCTL:
+            err = replay_ioctl(fd, rec);
+            break;
+        }
+
+        lat_add(&r->lat[rec->op], now_ns() - t0);
+        if (err)
+            r->lat[rec->op].errors++;
+        else if (n > 0)
+            r->lat[rec->op].bytes += n;
+    }
+
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static int load_trace(const char *path, struct trc_rec **recs)
+{
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        die(path);
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRC_MAGIC, 8) ||
+        hdr.version != TRC_VERSION) {
+        fprintf(stderr, "%s is not an io_replay trace\n", path);
+        exit(1);
+    }
+    if (!(*recs = malloc(hdr.nr_recs * sizeof(**recs) + 1))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if (fread(*recs, sizeof(**recs), hdr.nr_recs, f) != hdr.nr_recs) {
+        fprintf(stderr, "%s is truncated\n", path);
+        exit(1);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void print_op(const char *name, const struct lat *l, int last)
+{
+    printf("  \"%s\": {\n", name);
+    printf("    \"ops\": %llu,\n", l->ops);
+    printf("    \"bytes\": %llu,\n", l->bytes);
+    printf("    \"errors\": %llu,\n", l->errors);
+    printf("    \"lat_ns\": {\n");
+    printf("      \"min\": %llu,\n", l->ops ? l->min_ns : 0ULL);
+    printf("      \"mean\": %.1f,\n", l->ops ? (double)l->sum_ns / l->ops : 0.0);
+    printf("      \"p50\": %llu,\n", (unsigned long long)lat_pct(l, 50));
+    printf("      \"p99\": %llu,\n", (unsigned long long)lat_pct(l, 99));
+    printf("      \"p999\": %llu,\n", (unsigned long long)lat_pct(l, 99.9));
+    printf("      \"max\": %llu\n", l->max_ns);
+    printf("    }\n");
+    printf("  }%s\n", last ? "" : ",");
+}
+
+static int do_replay(int argc, char **argv)
+{
+    struct lat total[NR_OPS];
+    struct replayer *r;
+    struct trc_rec *recs;
+    unsigned long long skipped = 0, lag_sum = 0;
+    uint64_t lag_max = 0, t_end;
+    unsigned int t;
+    int opt, keep = 0, fd, o;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "f:x:k")) != -1) {
+        switch (opt) {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'x':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (optind != argc - 1 || speed < 0)
+        return -1;
+
+    load_trace(argv[optind], &recs);
+    if (!hdr.nr_threads)
+        hdr.nr_threads = 1;
+    if (!(r = calloc(hdr.nr_threads, sizeof(*r)))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    // Split the records per thread, keeping their order
+    for (i = 0; i < hdr.nr_recs; i++) {
+        struct trc_rec *rec = &recs[i];
+
+        if (rec->thread >= hdr.nr_threads) {
+            fprintf(stderr, "record %zu has a bad thread number\n", i);
+            exit(1);
+        }
+        r[rec->thread].nr++;
+        if ((rec->op == OP_READ || rec->op == OP_WRITE) && rec->len > max_len)
+            max_len = rec->len;
+        if (rec->op == OP_FAULT && (rec->pos + 1) * hdr.page_size > map_len)
+            map_len = (rec->pos + 1) * hdr.page_size;
+    }
+    for (t = 0; t < hdr.nr_threads; t++) {
+        if (!(r[t].recs = malloc(r[t].nr * sizeof(*r[t].recs) + 1))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        r[t].nr = 0;
+    }
+    for (i = 0; i < hdr.nr_recs; i++)
+        r[recs[i].thread].recs[r[recs[i].thread].nr++] = &recs[i];
+
+    if (!keep)
+        fill_image(hdr.dev_size);
+
+    // One shared mapping for all threads, like the threads of the workload
+    if (map_len) {
+        if (hdr.page_size != (uint32_t)sysconf(_SC_PAGESIZE)) {
+            fprintf(stderr, "trace page size %u differs, faults are skipped\n",
+                    hdr.page_size);
+        } else {
+            if ((fd = open(filename, O_RDWR)) < 0)
+                die(filename);
+            map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+                die("mmap");
+            close(fd);
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, hdr.nr_threads + 1);
+    for (t = 0; t < hdr.nr_threads; t++) {
+        if (pthread_create(&r[t].tid, NULL, replay_fn, &r[t])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    // Every thread has its fd open before the clock starts
+    t_start = now_ns();
+    pthread_barrier_wait(&start_barrier);
+
+    memset(total, 0, sizeof(total));
+    for (t = 0; t < hdr.nr_threads; t++) {
+        pthread_join(r[t].tid, NULL);
+        for (o = 0; o < NR_OPS; o++)
+            lat_merge(&total[o], &r[t].lat[o]);
+        skipped += r[t].skipped;
+        lag_sum += r[t].lag_sum_ns;
+        if (r[t].lag_max_ns > lag_max)
+            lag_max = r[t].lag_max_ns;
+    }
+    t_end = now_ns();
+
+    printf("{\n");
+    printf("  \"device\": \"%s\",\n", filename);
+    printf("  \"trace\": \"%s\",\n", argv[optind]);
+    printf("  \"speed\": %g,\n", speed);
+    printf("  \"threads\": %u,\n", hdr.nr_threads);
+    printf("  \"records\": %llu,\n", (unsigned long long)hdr.nr_recs);
+    printf("  \"skipped\": %llu,\n", skipped);
+    printf("  \"traced_seconds\": %.3f,\n",
+           hdr.nr_recs ? recs[hdr.nr_recs - 1].ts_ns / 1e9 : 0.0);
+    printf("  \"seconds\": %.3f,\n", (t_end - t_start) / 1e9);
+    printf("  \"lag_ns\": { \"mean\": %.1f, \"max\": %llu },\n",
+           hdr.nr_recs > skipped ? (double)lag_sum / (hdr.nr_recs - skipped) : 0.0,
+           (unsigned long long)lag_max);
+    for (o = 0; o < NR_OPS; o++)
+        print_op(op_names[o], &total[o], o == NR_OPS - 1);
+    printf("}\n");
+
+    if (map)
+        munmap(map, map_len);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s record [-f device] [-o trace] [-d seconds] [-- command ...]\n"
+            "       %s replay [-f device] [-x speed] [-k] trace\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int rc = -1;
+
+    if (argc < 2)
+        usage(argv[0]);
+    if (!strcmp(argv[1], "record"))
+        rc = do_record(argc - 1, argv + 1);
+    else if (!strcmp(argv[1], "replay"))
+        rc = do_replay(argc - 1, argv + 1);
+    if (rc < 0)
+        usage(argv[0]);
+    return rc;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -8,11 +9,11 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <malloc.h>
+#include <poll.h>
+#include <linux/falloc.h>
 
-// These definitions MUST match the driver (asgn1_skel.c)
-#define ASGN1_IOCTL_BASE 0xF1
-#define ASGN1_IOCTL_SET_MAX_USERS _IOW(ASGN1_IOCTL_BASE, 0x01, int)
-#define ASGN1_IOCTL_GET_MAX_USERS _IOR(ASGN1_IOCTL_BASE, 0x02, int)
+// Shared with the driver (asgn1_skel.c)
+#include "asgn1_ioctl.h"
 
 ssize_t my_fread(int fildes, void *buf, size_t nbyte) {
     ssize_t read_size;
@@ -145,6 +146,219 @@ int main (int argc, char **argv)
     printf ("comparison of modified data via read() and mmap() successful\n");
 
 
+    /* Store one page past EOF through a fresh shared mapping, it must grow the device */
+
+    {
+        long pg = sysconf (_SC_PAGESIZE);
+        off_t end = lseek (fd, 0, SEEK_END);
+        off_t grown_to = (end + pg - 1) / pg * pg + pg;
+        char *grow_buf;
+
+        grow_buf = mmap (NULL, grown_to, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (grow_buf == (char *)MAP_FAILED) {
+            fprintf (stderr, "mmap past EOF failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        grow_buf[grown_to - 1] = 0x5a;
+        munmap (grow_buf, grown_to);
+        if (lseek (fd, 0, SEEK_END) != grown_to) {
+            fprintf (stderr, "mmap store past EOF did not grow the device\n");
+            exit (1);
+        }
+        printf ("store past EOF grew the device to %ld bytes\n", (long)grown_to);
+    }
+
+
+    /* Punch a hole in the middle, it must read back as zeros and be found by SEEK_HOLE */
+
+    {
+        long pg = sysconf (_SC_PAGESIZE);
+        struct asgn1_falloc fa = {
+            .mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            .offset = pg,
+            .len = 2 * pg,
+        };
+        off_t hole;
+
+        if (ioctl (fd, ASGN1_IOCTL_FALLOCATE, &fa) < 0) {
+            fprintf (stderr, "ioctl FALLOCATE failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        if ((hole = lseek (fd, 0, SEEK_HOLE)) != pg) {
+            fprintf (stderr, "SEEK_HOLE returned %ld, expected %ld\n", (long)hole, pg);
+            exit (1);
+        }
+        if (lseek (fd, pg, SEEK_DATA) != 3 * pg) {
+            fprintf (stderr, "SEEK_DATA did not skip the hole\n");
+            exit (1);
+        }
+        memset (buf, 0, 2 * pg);
+        (void)lseek (fd, pg, SEEK_SET);
+        read_and_compare (fd, read_buf, buf, 2 * pg);
+        if (memcmp (mmap_buf + pg, buf, 2 * pg) != 0) {
+            fprintf (stderr, "hole reads non-zero through mmap\n");
+            exit (1);
+        }
+        printf ("punched hole reads as zeros via read() and mmap()\n");
+
+        /* Preallocating fills the hole again, still zeros, size unchanged */
+        fa.mode = FALLOC_FL_KEEP_SIZE;
+        if (ioctl (fd, ASGN1_IOCTL_FALLOCATE, &fa) < 0) {
+            fprintf (stderr, "ioctl FALLOCATE (prealloc) failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        if (lseek (fd, 0, SEEK_HOLE) == pg) {
+            fprintf (stderr, "preallocated range is still a hole\n");
+            exit (1);
+        }
+        (void)lseek (fd, pg, SEEK_SET);
+        read_and_compare (fd, read_buf, buf, 2 * pg);
+        printf ("preallocated hole is resident and reads as zeros\n");
+
+        /* Zero a range that starts on a page boundary and ends inside that page */
+        memset (buf, 0x5a, 200);
+        if (pwrite (fd, buf, 200, 0) != 200) {
+            fprintf (stderr, "pwrite failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        fa.mode = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+        fa.offset = 0;
+        fa.len = 100;
+        if (ioctl (fd, ASGN1_IOCTL_FALLOCATE, &fa) < 0) {
+            fprintf (stderr, "ioctl FALLOCATE (zero range) failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        memset (buf, 0, 100);
+        (void)lseek (fd, 0, SEEK_SET);
+        read_and_compare (fd, read_buf, buf, 200);
+        printf ("zeroing [0, 100) cleared only those bytes\n");
+    }
+
+
+    /* Snapshot, then change the original through mmap and write(): the snapshot keeps the old bytes */
+
+    {
+        char snap_name[32];
+        int snap_minor = -1, snap_fd;
+
+        if (ioctl (fd, ASGN1_IOCTL_SNAPSHOT, &snap_minor) < 0) {
+            fprintf (stderr, "ioctl SNAPSHOT failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        snprintf (snap_name, sizeof (snap_name), "/dev/asgn1%d", snap_minor);
+        if ((snap_fd = open (snap_name, O_RDONLY)) < 0) {
+            fprintf (stderr, "open of %s failed:  %s\n", snap_name, strerror (errno));
+            exit (1);
+        }
+
+        memcpy (buf, mmap_buf, SIZE);
+        mmap_buf[0] ^= 0xff;
+        for (i = 0; i < 16; i++)
+            read_buf[i] = ~buf[SIZE / 2 + i];
+        (void)lseek (fd, SIZE / 2, SEEK_SET);
+        my_fwrite (fd, read_buf, 16);
+
+        read_and_compare (snap_fd, read_buf, buf, SIZE);
+        close (snap_fd);
+        if (ioctl (fd, ASGN1_IOCTL_DESTROY_DEV, &snap_minor) < 0) {
+            fprintf (stderr, "ioctl DESTROY_DEV failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        printf ("snapshot %s kept its data while the original changed\n", snap_name);
+    }
+
+
+    /* Follow mode: a reader at EOF gets EAGAIN and no POLLIN until a write appends */
+
+    {
+        struct pollfd pfd;
+        char c = 0;
+        int fd2, val = 1;
+
+        if ((fd2 = open (filename, O_RDONLY | O_NONBLOCK)) < 0) {
+            fprintf (stderr, "open of %s failed:  %s\n", filename, strerror (errno));
+            exit (1);
+        }
+        if (ioctl (fd2, ASGN1_IOCTL_SET_FOLLOW, &val) < 0) {
+            fprintf (stderr, "ASGN1_IOCTL_SET_FOLLOW failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        (void)lseek (fd2, 0, SEEK_END);
+        if (read (fd2, &c, 1) >= 0 || errno != EAGAIN) {
+            fprintf (stderr, "O_NONBLOCK read at EOF in follow mode did not fail with EAGAIN\n");
+            exit (1);
+        }
+        pfd.fd = fd2;
+        pfd.events = POLLIN;
+        assert (poll (&pfd, 1, 0) == 0);
+
+        (void)lseek (fd, 0, SEEK_END);
+        my_fwrite (fd, "x", 1);
+        assert (poll (&pfd, 1, 1000) == 1 && (pfd.revents & POLLIN));
+        assert (read (fd2, &c, 1) == 1 && c == 'x');
+
+        /* Follow mode is per open file, the writer's reads still see EOF */
+        (void)lseek (fd, 0, SEEK_END);
+        assert (read (fd, &c, 1) == 0);
+        close (fd2);
+        printf ("follow mode reader woke on append\n");
+    }
+
+
+    /* A store into the partial last page must not move EOF to the page end */
+
+    {
+        long pg = sysconf (_SC_PAGESIZE);
+        off_t end = lseek (fd, 0, SEEK_END), base;
+        char *tail;
+
+        if (end % pg == 0) {
+            my_fwrite (fd, "t", 1);
+            end++;
+        }
+        base = end / pg * pg;
+        tail = mmap (NULL, pg, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+        if (tail == (char *)MAP_FAILED) {
+            fprintf (stderr, "mmap of the last page failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        tail[end - base - 1] ^= 0xff;
+        munmap (tail, pg);
+        if (lseek (fd, 0, SEEK_END) != end) {
+            fprintf (stderr, "store in the partial last page moved EOF from %ld to %ld\n",
+                     (long)end, (long)lseek (fd, 0, SEEK_END));
+            exit (1);
+        }
+        printf ("store in the partial last page kept EOF at %ld\n", (long)end);
+    }
+
+
+    /* With max_users at 1 our own open holds the only slot, O_NONBLOCK must not queue */
+
+    {
+        struct asgn1_open_stats os;
+        int one = 1, unlimited = 0, fd2;
+
+        if (ioctl (fd, ASGN1_IOCTL_SET_MAX_USERS, &one) < 0) {
+            fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        fd2 = open (filename, O_RDONLY | O_NONBLOCK);
+        if (fd2 >= 0 || errno != EBUSY) {
+            fprintf (stderr, "O_NONBLOCK open past max_users did not fail with EBUSY\n");
+            exit (1);
+        }
+        if (ioctl (fd, ASGN1_IOCTL_GET_OPEN_STATS, &os) < 0) {
+            fprintf (stderr, "ioctl GET_OPEN_STATS failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        assert (os.rejected > 0 && os.queued == 0);
+        (void)ioctl (fd, ASGN1_IOCTL_SET_MAX_USERS, &unlimited);
+        printf ("O_NONBLOCK open past max_users refused, %llu rejected so far\n",
+                (unsigned long long)os.rejected);
+    }
+
+
     (void)lseek (fd, 0, SEEK_SET);
 
     if (ioctl (fd, ASGN1_IOCTL_SET_MAX_USERS, &nproc) < 0) {
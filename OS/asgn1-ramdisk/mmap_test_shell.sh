@@ -13,7 +13,13 @@ if [[ $EUID -ne 0 ]]; then
 fi
 
 echo "--- Loading the ramdisk module ---"
-insmod ${MODULE_NAME}.ko
+# insmod doesn't resolve dependencies, load the LZ4 and xxhash libraries first
+# (a no-op when they are built in)
+if ! modprobe -a lz4_compress lz4_decompress xxhash; then
+    echo "Error: the kernel needs CONFIG_LZ4_COMPRESS, CONFIG_LZ4_DECOMPRESS and CONFIG_XXHASH."
+    exit 1
+fi
+insmod ${MODULE_NAME}.ko || exit 1
 sleep 1 # Give the kernel a moment to load
 
 # Get the major number from dmesg, just in case it's different
@@ -26,8 +32,14 @@ else
     echo "Could not find major number in dmesg. Using default: ${MAJOR_NUM}"
 fi
 
-echo "--- Creating device node: ${DEVICE_NAME} ---"
-mknod ${DEVICE_NAME} c ${MAJOR_NUM} 0
+# The module asks udev for the node; only fall back to mknod without udev
+udevadm settle 2>/dev/null
+CREATED_NODE=0
+if [ ! -c "${DEVICE_NAME}" ]; then
+    echo "--- Creating device node: ${DEVICE_NAME} ---"
+    mknod -m 666 ${DEVICE_NAME} c ${MAJOR_NUM} 0
+    CREATED_NODE=1
+fi
 
 # Check if the device node was created successfully
 if [ ! -c "${DEVICE_NAME}" ]; then
@@ -45,8 +57,10 @@ echo "--- Running the mmap test program ---"
 chmod +x ./mmap_test
 ./mmap_test ${DEVICE_NAME}
 
-echo "--- Cleaning up: Removing the device node ---"
-rm ${DEVICE_NAME}
+if [ ${CREATED_NODE} -eq 1 ]; then
+    echo "--- Cleaning up: Removing the device node ---"
+    rm ${DEVICE_NAME}
+fi
 
 echo "--- Unloading the ramdisk module ---"
 rmmod ${MODULE_NAME}
@@ -0,0 +1,281 @@
+/*
+ * scale_bench - thread scaling benchmark for /dev/asgn1
+ *
+ * Fills the device with a fixed image, then runs 1, 2, 4, ... up to
+ * max threads against it and prints aggregate throughput per step.
+ * Each thread has its own fd and uses pread()/pwrite() so file
+ * positions don't interfere.
+ *
+ *   reader mode: every thread preads random blocks of the whole image.
+ *   writer mode: every thread pwrites random blocks of its own slice, so
+ *                writers never overlap and only the range lock is tested.
+ *   mixed mode:  half the threads read, half write.
+ *   scan mode:   every thread mmaps its own 2 MiB aligned slice, reads
+ *                every word of it and unmaps it again, so each pass pays
+ *                the first-touch fault cost of the mmap path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define DEF_IMAGE_MB    64
+#define DEF_BLOCK       4096
+#define DEF_SECONDS     2
+#define DEF_MAX_THREADS 32
+#define SCAN_ALIGN      (2UL << 20)
+
+enum mode { MODE_READ, MODE_WRITE, MODE_MIXED, MODE_SCAN };
+
+struct worker {
+    pthread_t tid;
+    int id;
+    int nthreads;
+    int writer;
+    unsigned long long ops;
+};
+
+static const char *filename = "/dev/asgn1";
+static size_t image_size = (size_t)DEF_IMAGE_MB << 20;
+static size_t block = DEF_BLOCK;
+static int seconds = DEF_SECONDS;
+static enum mode mode = MODE_READ;
+static volatile int stop;
+static volatile uint64_t scan_sink;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * mmap, read and unmap this thread's slice until told to stop.
+ * ops counts blocks so the MiB/s column stays comparable.
+ */
+static void scan_loop(struct worker *w, int fd)
+{
+    size_t slice = image_size / w->nthreads & ~(SCAN_ALIGN - 1);
+    off_t off;
+
+    if (!slice)
+        slice = image_size & ~(SCAN_ALIGN - 1);
+    if (!slice)
+        slice = image_size;
+    off = (off_t)slice * w->id;
+    if ((size_t)off + slice > image_size)
+        off = 0;
+
+    while (!stop) {
+        const uint64_t *p = mmap(NULL, slice, PROT_READ, MAP_SHARED, fd, off);
+        uint64_t sum = 0;
+        size_t i;
+
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "mmap failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+        for (i = 0; i < slice / sizeof(*p); i++)
+            sum += p[i];
+        scan_sink += sum;
+        munmap((void *)p, slice);
+        w->ops += slice / block;
+    }
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    size_t nblocks = image_size / block;
+    size_t first = 0, span = nblocks;
+    unsigned int seed = 0x9e3779b9u * (w->id + 1);
+    char *buf;
+    int fd;
+
+    if ((fd = open(filename, O_RDWR)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    if (!(buf = malloc(block))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, w->id, block);
+
+    if (mode == MODE_SCAN) {
+        scan_loop(w, fd);
+        goto out;
+    }
+
+    // Writers own a disjoint slice of the image
+    if (w->writer) {
+        span = nblocks / w->nthreads;
+        first = span * w->id;
+        if (!span)
+            span = 1;
+    }
+
+    while (!stop) {
+        off_t off = (off_t)(first + rand_r(&seed) % span) * block;
+        ssize_t n = w->writer ? pwrite(fd, buf, block, off)
+                              : pread(fd, buf, block, off);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s failed:  %s\n", w->writer ? "pwrite" : "pread",
+                    strerror(errno));
+            exit(1);
+        }
+        w->ops++;
+    }
+
+out:
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void fill_image(void)
+{
+    size_t done = 0;
+    char *buf;
+    int fd;
+
+    // O_WRONLY truncates the device, giving every run the same image
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    if (!(buf = malloc(1 << 20))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 0xa5, 1 << 20);
+
+    while (done < image_size) {
+        size_t len = image_size - done < (1 << 20) ? image_size - done : (1 << 20);
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+        done += n;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void run_step(int nthreads)
+{
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    unsigned long long rd = 0, wr = 0;
+    double t0, t1;
+    int i;
+
+    if (!w) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    stop = 0;
+    t0 = now_sec();
+    for (i = 0; i < nthreads; i++) {
+        w[i].id = i;
+        w[i].nthreads = nthreads;
+        w[i].writer = mode == MODE_WRITE || (mode == MODE_MIXED && (i & 1));
+        if (pthread_create(&w[i].tid, NULL, worker_fn, &w[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        if (w[i].writer)
+            wr += w[i].ops;
+        else
+            rd += w[i].ops;
+    }
+    t1 = now_sec();
+
+    printf("%7d %14.0f %14.0f %12.1f\n", nthreads,
+           rd / (t1 - t0), wr / (t1 - t0),
+           (rd + wr) * (double)block / (t1 - t0) / (1 << 20));
+    free(w);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-f device] [-m read|write|mixed|scan] [-s image_mb]\n"
+            "          [-b block_bytes] [-t max_threads] [-d seconds]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = DEF_MAX_THREADS;
+    int opt, n;
+
+    while ((opt = getopt(argc, argv, "f:m:s:b:t:d:")) != -1) {
+        switch (opt) {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "read"))
+                mode = MODE_READ;
+            else if (!strcmp(optarg, "write"))
+                mode = MODE_WRITE;
+            else if (!strcmp(optarg, "mixed"))
+                mode = MODE_MIXED;
+            else if (!strcmp(optarg, "scan"))
+                mode = MODE_SCAN;
+            else
+                usage(argv[0]);
+            break;
+        case 's':
+            image_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'b':
+            block = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!block || image_size < block || max_threads < 1 || seconds < 1)
+        usage(argv[0]);
+
+    fill_image();
+
+    printf("# %s image=%zu MiB block=%zu %ds per step\n", filename,
+           image_size >> 20, block, seconds);
+    printf("%7s %14s %14s %12s\n", "threads", "read_ops/s", "write_ops/s", "MiB/s");
+    for (n = 1; n <= max_threads; n *= 2)
+        run_step(n);
+    if ((n >> 1) != max_threads)
+        run_step(max_threads);
+
+    return 0;
+}
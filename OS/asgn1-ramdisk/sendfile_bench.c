@@ -0,0 +1,261 @@
+/*
+ * sendfile_bench - serve /dev/asgn1 over loopback TCP
+ *
+ * Fills the device with a fixed image, then streams it to a receiver
+ * thread over a 127.0.0.1 socket several times, once with
+ * read() + send() through a user buffer and once with sendfile(),
+ * which goes through the driver's zero copy splice_read.
+ *
+ * Prints bandwidth and the sender's CPU time for each, the receiver
+ * only drains the socket and isn't counted.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEF_IMAGE_MB    256
+#define DEF_PASSES      4
+#define COPY_CHUNK      (1 << 20)
+
+static const char *filename = "/dev/asgn1";
+static size_t image_size = (size_t)DEF_IMAGE_MB << 20;
+static int passes = DEF_PASSES;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// User + system CPU seconds of the calling thread
+static double thread_cpu_sec(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *drain_fn(void *arg)
+{
+    int sock = *(int *)arg;
+    char *buf = malloc(COPY_CHUNK);
+    ssize_t n;
+
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    while ((n = recv(sock, buf, COPY_CHUNK, 0)) != 0) {
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "recv failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    free(buf);
+    close(sock);
+    return NULL;
+}
+
+// Connected loopback TCP pair, *rx is drained by its own thread
+static int connect_pair(pthread_t *tid, int *rx)
+{
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    int lsock, tx;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lsock, 1) < 0 ||
+        getsockname(lsock, (struct sockaddr *)&addr, &alen) < 0) {
+        fprintf(stderr, "listen failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+    if ((tx = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(tx, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        (*rx = accept(lsock, NULL, NULL)) < 0) {
+        fprintf(stderr, "connect failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+    close(lsock);
+
+    if (pthread_create(tid, NULL, drain_fn, rx)) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
+    }
+    return tx;
+}
+
+static void send_copy(int fd, int sock, char *buf)
+{
+    off_t off = 0;
+
+    while ((size_t)off < image_size) {
+        ssize_t n = pread(fd, buf, COPY_CHUNK, off);
+        ssize_t done = 0;
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "pread failed:  %s\n", n ? strerror(errno) : "short image");
+            exit(1);
+        }
+        while (done < n) {
+            ssize_t m = send(sock, buf + done, n - done, 0);
+
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "send failed:  %s\n", strerror(errno));
+                exit(1);
+            }
+            done += m;
+        }
+        off += n;
+    }
+}
+
+static void send_sendfile(int fd, int sock)
+{
+    off_t off = 0;
+
+    while ((size_t)off < image_size) {
+        ssize_t n = sendfile(sock, fd, &off, image_size - off);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "sendfile failed:  %s\n", n ? strerror(errno) : "short image");
+            exit(1);
+        }
+    }
+}
+
+static void run(const char *name, int use_sendfile)
+{
+    pthread_t tid;
+    char *buf = malloc(COPY_CHUNK);
+    double t0, t1, c0, c1;
+    int fd, sock, rx, i;
+
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    sock = connect_pair(&tid, &rx);
+
+    t0 = now_sec();
+    c0 = thread_cpu_sec();
+    for (i = 0; i < passes; i++) {
+        if (use_sendfile)
+            send_sendfile(fd, sock);
+        else
+            send_copy(fd, sock, buf);
+    }
+    c1 = thread_cpu_sec();
+    t1 = now_sec();
+
+    shutdown(sock, SHUT_WR);
+    pthread_join(tid, NULL);
+    close(sock);
+    close(fd);
+    free(buf);
+
+    printf("%-9s %12.1f %12.3f %8.1f\n", name,
+           image_size * (double)passes / (t1 - t0) / (1 << 20),
+           c1 - c0, (c1 - c0) / (t1 - t0) * 100);
+}
+
+static void fill_image(void)
+{
+    size_t done = 0;
+    char *buf;
+    int fd;
+
+    // O_WRONLY truncates the device, giving every run the same image
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    if (!(buf = malloc(1 << 20))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 0xa5, 1 << 20);
+
+    while (done < image_size) {
+        size_t len = image_size - done < (1 << 20) ? image_size - done : (1 << 20);
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+        done += n;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f device] [-s image_mb] [-n passes]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:n:")) != -1) {
+        switch (opt) {
+        case 'f':
+            filename = optarg;
+            break;
+        case 's':
+            image_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!image_size || passes < 1)
+        usage(argv[0]);
+
+    fill_image();
+
+    printf("# %s image=%zu MiB x %d passes over 127.0.0.1\n", filename,
+           image_size >> 20, passes);
+    printf("%-9s %12s %12s %8s\n", "mode", "MiB/s", "sender_cpu_s", "cpu_%");
+    run("copy", 0);
+    run("sendfile", 1);
+    return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * uring_bench - io_uring queue depth benchmark for /dev/asgn1
+ *
+ * Fills the device with a fixed image, then keeps 1, 2, 4, ... up to
+ * max queue depth random reads (or writes) in flight through one
+ * io_uring and prints IOPS, bandwidth and mean completion latency
+ * per step.
+ *
+ * With -v n every block is split into n iovecs and issued as
+ * IORING_OP_READV/WRITEV, which goes through the driver's
+ * read_iter/write_iter scatter path in one call.
+ *
+ * Talks to io_uring through the raw syscalls, so liburing isn't needed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define DEF_IMAGE_MB    64
+#define DEF_BLOCK       4096
+#define DEF_SECONDS     2
+#define DEF_MAX_QD      128
+#define MAX_IOVECS      64
+
+struct ring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+struct slot {
+    char *buf;
+    struct iovec iov[MAX_IOVECS];
+    double issued;
+};
+
+static const char *filename = "/dev/asgn1";
+static size_t image_size = (size_t)DEF_IMAGE_MB << 20;
+static size_t block = DEF_BLOCK;
+static int seconds = DEF_SECONDS;
+static int do_write;
+static int nvec;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ring_setup(struct ring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        fprintf(stderr, "io_uring_setup failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+        sq_len = cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        fprintf(stderr, "mmap of SQ ring failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            fprintf(stderr, "mmap of CQ ring failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        fprintf(stderr, "mmap of SQEs failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head  = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+// Queue one request for slot id at a random block offset
+static void queue_io(struct ring *r, int devfd, struct slot *s, int id, unsigned int *seed)
+{
+    unsigned int tail = *r->sq_tail;
+    unsigned int idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    size_t nblocks = image_size / block;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = devfd;
+    sqe->off = (uint64_t)(rand_r(seed) % nblocks) * block;
+    sqe->user_data = id;
+    if (nvec) {
+        sqe->opcode = do_write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)s->iov;
+        sqe->len = nvec;
+    } else {
+        sqe->opcode = do_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->addr = (uintptr_t)s->buf;
+        sqe->len = block;
+    }
+    r->sq_array[idx] = idx;
+    s->issued = now_sec();
+
+    // Publish the SQE before the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void run_step(int devfd, int qd)
+{
+    struct ring r;
+    struct slot *slots = calloc(qd, sizeof(*slots));
+    unsigned int seed = 0x9e3779b9u * qd;
+    unsigned long long done = 0;
+    double lat_sum = 0, t0, t1, deadline;
+    int inflight = 0, i, v;
+
+    if (!slots) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    ring_setup(&r, qd);
+
+    for (i = 0; i < qd; i++) {
+        if (!(slots[i].buf = malloc(block))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memset(slots[i].buf, i, block);
+        for (v = 0; v < nvec; v++) {
+            slots[i].iov[v].iov_base = slots[i].buf + block / nvec * v;
+            slots[i].iov[v].iov_len = block / nvec;
+        }
+    }
+
+    t0 = now_sec();
+    deadline = t0 + seconds;
+    for (i = 0; i < qd; i++)
+        queue_io(&r, devfd, &slots[i], i, &seed);
+    inflight = qd;
+
+    while (inflight) {
+        unsigned int to_submit = *r.sq_tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+        unsigned int head, tail;
+        double now;
+
+        if (syscall(__NR_io_uring_enter, r.fd, to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "io_uring_enter failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+
+        now = now_sec();
+        head = *r.cq_head;
+        tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            int id = (int)cqe->user_data;
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "%s failed:  %s\n", do_write ? "write" : "read",
+                        strerror(-cqe->res));
+                exit(1);
+            }
+            lat_sum += now - slots[id].issued;
+            done++;
+            inflight--;
+            if (now < deadline) {
+                queue_io(&r, devfd, &slots[id], id, &seed);
+                inflight++;
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+    t1 = now_sec();
+
+    printf("%7d %12.0f %12.1f %12.2f\n", qd, done / (t1 - t0),
+           done * (double)block / (t1 - t0) / (1 << 20),
+           done ? lat_sum / done * 1e6 : 0.0);
+
+    for (i = 0; i < qd; i++)
+        free(slots[i].buf);
+    free(slots);
+    close(r.fd);
+}
+
+static void fill_image(void)
+{
+    size_t done = 0;
+    char *buf;
+    int fd;
+
+    // O_WRONLY truncates the device, giving every run the same image
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    if (!(buf = malloc(1 << 20))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 0xa5, 1 << 20);
+
+    while (done < image_size) {
+        size_t len = image_size - done < (1 << 20) ? image_size - done : (1 << 20);
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+        done += n;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-f device] [-m read|write] [-s image_mb] [-b block_bytes]\n"
+            "          [-q max_qd] [-v iovecs] [-d seconds]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int max_qd = DEF_MAX_QD;
+    int opt, qd, fd;
+
+    while ((opt = getopt(argc, argv, "f:m:s:b:q:v:d:")) != -1) {
+        switch (opt) {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "read"))
+                do_write = 0;
+            else if (!strcmp(optarg, "write"))
+                do_write = 1;
+            else
+                usage(argv[0]);
+            break;
+        case 's':
+            image_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'b':
+            block = strtoull(optarg, NULL, 0);
+            break;
+        case 'q':
+            max_qd = atoi(optarg);
+            break;
+        case 'v':
+            nvec = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!block || image_size < block || max_qd < 1 || max_qd > 4096 || seconds < 1 ||
+        nvec < 0 || nvec > MAX_IOVECS || (nvec && block % nvec))
+        usage(argv[0]);
+
+    fill_image();
+
+    if ((fd = open(filename, O_RDWR)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    printf("# %s image=%zu MiB block=%zu %s%s %ds per step\n", filename,
+           image_size >> 20, block, do_write ? "write" : "read",
+           nvec ? "v" : "", seconds);
+    printf("%7s %12s %12s %12s\n", "qd", "iops", "MiB/s", "avg_lat_us");
+    for (qd = 1; qd <= max_qd; qd *= 2)
+        run_step(fd, qd);
+    if ((qd >> 1) != max_qd)
+        run_step(fd, max_qd);
+
+    close(fd);
+    return 0;
+}